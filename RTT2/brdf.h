@@ -11,6 +11,29 @@ namespace rtt2 {
 		}
 
 		virtual void get_illum(const vec3&, const vec3&, const vec3&, const color_vec_rgb&, color_vec_rgb&) const = 0;
+		// adds the illuminations of n lights, clamped to 0 & weighted by w, to res
+		virtual void add_illum_n(
+			const vec3 *in, const vec3 &out, const vec3 &normal, const color_vec_rgb *c, const rtt2_float *w, size_t n, color_vec_rgb &res
+		) const {
+			color_vec_rgb cr;
+			for (size_t k = 0; k < n; ++k) {
+				get_illum(in[k], out, normal, c[k], cr);
+				max_vec(cr, 0.0);
+				res += cr * w[k];
+			}
+		}
+	protected:
+		// add_illum_n() with the get_illum() of T called directly, for the overrides of the built-in brdfs
+		template <typename T> inline static void _add_illum_n(
+			const T &b, const vec3 *in, const vec3 &out, const vec3 &normal, const color_vec_rgb *c, const rtt2_float *w, size_t n, color_vec_rgb &res
+		) {
+			color_vec_rgb cr;
+			for (size_t k = 0; k < n; ++k) {
+				b.T::get_illum(in[k], out, normal, c[k], cr);
+				max_vec(cr, 0.0);
+				res += cr * w[k];
+			}
+		}
 	};
 
 	struct brdf_diffuse : public brdf {
@@ -23,6 +46,11 @@ namespace rtt2 {
 		void get_illum(const vec3 &in, const vec3 &out, const vec3 &normal, const color_vec_rgb &c, color_vec_rgb &res) const override {
 			res = -diffuse * vec3::dot(in, normal) * c;
 		}
+		void add_illum_n(
+			const vec3 *in, const vec3 &out, const vec3 &normal, const color_vec_rgb *c, const rtt2_float *w, size_t n, color_vec_rgb &res
+		) const override {
+			_add_illum_n(*this, in, out, normal, c, w, n, res);
+		}
 	};
 	struct brdf_phong : public brdf {
 		brdf_phong() = default;
@@ -33,7 +61,12 @@ namespace rtt2 {
 
 		void get_illum(const vec3 &in, const vec3 &out, const vec3 &normal, const color_vec_rgb &c, color_vec_rgb &res) const override {
 			rtt2_float ddotv = vec3::dot(in, normal);
-			res = (specular * std::pow(std::max(0.0, vec3::dot(out, in - ddotv * 2.0 * normal)), shiness) - diffuse * ddotv) * c;
+			res = (specular * std::pow(std::max<rtt2_float>(0.0, vec3::dot(out, in - ddotv * 2.0 * normal)), shiness) - diffuse * ddotv) * c;
+		}
+		void add_illum_n(
+			const vec3 *in, const vec3 &out, const vec3 &normal, const color_vec_rgb *c, const rtt2_float *w, size_t n, color_vec_rgb &res
+		) const override {
+			_add_illum_n(*this, in, out, normal, c, w, n, res);
 		}
 	};
 	struct brdf_ggx : public brdf { // TODO
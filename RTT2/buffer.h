@@ -190,14 +190,19 @@ namespace rtt2 {
 		typedef mem_buffer<unsigned char> mem_stencil_buffer;
 		class buffer_set {
 		public:
+			constexpr static size_t msaa_samples = 4;
+
 			buffer_set() = default;
-			buffer_set(size_t ww, size_t hh, device_color *c, rtt2_float *d, unsigned char *s) : w(ww), h(hh), color_arr(c), depth_arr(d), stencil_arr(s) {
+			buffer_set(size_t ww, size_t hh, device_color *c, rtt2_float *d, unsigned char *s) : w(ww), h(hh), color_arr(c), depth_arr(d), stencil_arr(s), sample_color_arr(nullptr), sample_depth_arr(nullptr) {
 			}
 
 			size_t w, h;
 			device_color *color_arr;
 			rtt2_float *depth_arr;
 			unsigned char *stencil_arr;
+			// msaa_samples consecutive elements per pixel; when set, triangles are rendered into these and then resolved
+			device_color *sample_color_arr;
+			rtt2_float *sample_depth_arr;
 
 			void set(size_t ww, size_t hh, device_color *c, rtt2_float *d, unsigned char *s) {
 				w = ww;
@@ -205,6 +210,23 @@ namespace rtt2 {
 				color_arr = c;
 				depth_arr = d;
 				stencil_arr = s;
+				sample_color_arr = nullptr;
+				sample_depth_arr = nullptr;
+			}
+			void set_msaa(device_color *sc, rtt2_float *sd) {
+				sample_color_arr = sc;
+				sample_depth_arr = sd;
+			}
+			bool has_msaa() const {
+				return sample_color_arr != nullptr;
+			}
+
+			// sample positions relative to the bottom-left corner of the pixel, in a rotated grid
+			inline static const vec2 *get_msaa_offsets() {
+				static const vec2 offsets[msaa_samples]{
+					{ 0.375, 0.125 }, { 0.875, 0.375 }, { 0.125, 0.625 }, { 0.625, 0.875 }
+				};
+				return offsets;
 			}
 
 			template <typename T> T *get_at(size_t x, size_t y, T *arr) const {
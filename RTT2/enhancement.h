@@ -1,6 +1,9 @@
 #pragma once
 
+#include <vector>
+
 #include "rasterizer.h"
+#include "sampler.h"
 
 namespace rtt2 {
 	namespace rasterizing {
@@ -10,20 +13,200 @@ namespace rtt2 {
 			}
 
 			virtual size_t get_additional_face_data_size() const = 0;
+			// the vertices are in object space; only called again when the geometry of the model changes
 			virtual void make_face_cache(const rasterizer::vertex_info*, void*) const = 0;
-			virtual bool before_test_shader(const rasterizer&, rasterizer::frag_info&, rtt2_float*, unsigned char*, void*) const = 0;
+			// the matrix takes the face data of the model into view space
+			virtual bool before_test_shader(const rasterizer&, rasterizer::frag_info&, const mat4&, rtt2_float*, unsigned char*, void*) const = 0;
+			// an upper bound of the depth that before_test_shader can give the fragment, given the face data
+			// fragments that can't pass the depth test with it are rejected without running the enhancement
+			virtual rtt2_float get_depth_bound(const rasterizer&, const rasterizer::frag_info&, const void*) const {
+				return INFINITY;
+			}
 		};
 
-		class parallax_occulusion_mapping_enhancement : public enhancement { // TODO optimization
+		class parallax_occulusion_mapping_enhancement : public enhancement {
 		public:
+			constexpr static size_t max_steps = 200;
+
 			rtt2_float depth = 0.0;
 			const texture *depth_tex = nullptr;
+			size_t refine_steps = 4; // binary search between the last position above the surface and the first one below
+
+			// builds a quadtree of the minimum depth under the bilinear footprint of each texel
+			// the march uses it to skip cells that the ray can't reach; call again whenever depth_tex changes
+			// only used when depth_tex repeats, otherwise every step is sampled
+			void make_cache() {
+				_min_depth.clear();
+				size_t w = depth_tex->get_w(), h = depth_tex->get_h();
+				_min_level lvl;
+				lvl.w = w;
+				lvl.h = h;
+				lvl.vals.resize(w * h);
+				for (size_t y = 0; y < h; ++y) {
+					for (size_t x = 0; x < w; ++x) {
+						rtt2_float m = 1.0;
+						for (size_t i = 0; i < 4; ++i) {
+							color_vec v;
+							depth_tex->fetch((x + (i & 1)) % w, (y + (i >> 1)) % h, v);
+							m = std::min<rtt2_float>(m, 1.0 - v.x);
+						}
+						lvl.vals[w * y + x] = m;
+					}
+				}
+				_min_depth.push_back(std::move(lvl));
+				while (_min_depth.back().w > 1 || _min_depth.back().h > 1) {
+					const _min_level &prev = _min_depth.back();
+					_min_level next;
+					next.w = (prev.w + 1) / 2;
+					next.h = (prev.h + 1) / 2;
+					next.vals.resize(next.w * next.h);
+					for (size_t y = 0; y < next.h; ++y) {
+						size_t y0 = y * 2, y1 = std::min(y * 2 + 1, prev.h - 1);
+						for (size_t x = 0; x < next.w; ++x) {
+							size_t x0 = x * 2, x1 = std::min(x * 2 + 1, prev.w - 1);
+							next.vals[next.w * y + x] = std::min(
+								std::min(prev.vals[prev.w * y0 + x0], prev.vals[prev.w * y0 + x1]),
+								std::min(prev.vals[prev.w * y1 + x0], prev.vals[prev.w * y1 + x1])
+							);
+						}
+					}
+					_min_depth.push_back(std::move(next));
+				}
+			}
 		protected:
 			struct _vertex_data {
 				vec2 uvd12, uvd13;
-				vec3 diff12, diff13, uvdx, uvdy;
+				vec3 diff12, diff13, uvdx, uvdy; // in object space, taken into view space by before_test_shader
+			};
+			struct _min_level {
+				size_t w, h;
+				std::vector<rtt2_float> vals;
 			};
+
+			std::vector<_min_level> _min_depth;
+
+			template <typename Sampler> bool _is_below(const vec2 &uv, rtt2_float zv) const {
+				color_vec v;
+				Sampler::sample(*depth_tex, uv, v);
+				return (1.0 - v.x) * depth < zv;
+			}
+			// the first of the 4 steps from step i on that ends below the surface, or 4 if none does
+			template <typename Sampler> size_t _first_below4(const vec2 &uv0, const vec2 &pres, rtt2_float zinc, size_t i) const {
+				vec2 uvs[4];
+				color_vec v[4];
+				for (size_t k = 0; k < 4; ++k) {
+					uvs[k] = uv0 + pres * (i + k);
+				}
+				Sampler::sample4(*depth_tex, uvs, v);
+				for (size_t k = 0; k < 4; ++k) {
+					if ((1.0 - v[k].x) * depth < zinc * (i + k + 1)) {
+						return k;
+					}
+				}
+				return 4;
+			}
+			// number of steps, starting from position t, whose base texel stays in [lo, hi)
+			inline static rtt2_float _get_steps_in_range(rtt2_float t, rtt2_float dt, rtt2_float lo, rtt2_float hi) {
+				constexpr rtt2_float eps = 1e-4;
+				if (dt > 0.0) {
+					return std::ceil((hi - eps - t) / dt);
+				}
+				if (dt < 0.0) {
+					return std::floor((t - lo - eps) / -dt) + 1.0;
+				}
+				return static_cast<rtt2_float>(max_steps);
+			}
+			// the number of steps from step i on that can't end below the surface, found from the coarsest cell that allows any
+			size_t _get_safe_steps(const vec2 &uv0, const vec2 &pres, rtt2_float zinc, size_t i) const {
+				size_t w = depth_tex->get_w(), h = depth_tex->get_h();
+				rtt2_float
+					tx = (uv0.x + pres.x * i) * w - 0.5, ty = (uv0.y + pres.y * i) * h - 0.5,
+					dx = pres.x * w, dy = pres.y * h, zv = zinc * (i + 1),
+					fx = std::floor(tx), fy = std::floor(ty);
+				int wx = static_cast<int>(fx), wy = static_cast<int>(fy);
+				coord_wrapper<uv_clamp_mode::repeat>::wrap(wx, w);
+				coord_wrapper<uv_clamp_mode::repeat>::wrap(wy, h);
+				rtt2_float offx = fx - wx, offy = fy - wy;
+				for (size_t l = _min_depth.size(); l > 0; ) {
+					const _min_level &lvl = _min_depth[--l];
+					size_t cx = static_cast<size_t>(wx) >> l, cy = static_cast<size_t>(wy) >> l;
+					rtt2_float m = lvl.vals[lvl.w * cy + cx] * depth;
+					if (m < zv) {
+						continue;
+					}
+					rtt2_float steps = std::floor((m - zv) / zinc - 1e-6) + 1.0;
+					steps = std::min(steps, _get_steps_in_range(tx, dx, (cx << l) + offx, ((cx + 1) << l) + offx));
+					steps = std::min(steps, _get_steps_in_range(ty, dy, (cy << l) + offy, ((cy + 1) << l) + offy));
+					if (steps >= 1.0) {
+						return static_cast<size_t>(std::min(steps, static_cast<rtt2_float>(max_steps)));
+					}
+				}
+				return 0;
+			}
+			// the position along the ray, in steps, where it first goes below the surface
+			// without the quadtree the steps are sampled 4 at a time
+			template <typename Sampler> rtt2_float _march(const vec2 &uv0, const vec2 &pres, rtt2_float zinc) const {
+				bool accel = (!_min_depth.empty() && depth_tex->mode_uv == uv_clamp_mode::repeat);
+				size_t i = 0;
+				while (i < max_steps) {
+					if (accel) {
+						size_t skip = _get_safe_steps(uv0, pres, zinc, i);
+						if (skip > 0) {
+							i += skip;
+							continue;
+						}
+					} else if (i + 4 <= max_steps) {
+						size_t k = _first_below4<Sampler>(uv0, pres, zinc, i);
+						i += k;
+						if (k < 4) {
+							break;
+						}
+						continue;
+					}
+					if (_is_below<Sampler>(uv0 + pres * i, zinc * (i + 1))) {
+						break;
+					}
+					++i;
+				}
+				if (i >= max_steps) {
+					return static_cast<rtt2_float>(max_steps);
+				}
+				if (i == 0 || refine_steps == 0) {
+					return static_cast<rtt2_float>(i);
+				}
+				rtt2_float lo = i - 1.0, hi = static_cast<rtt2_float>(i);
+				for (size_t j = 0; j < refine_steps; ++j) {
+					rtt2_float mid = 0.5 * (lo + hi);
+					if (_is_below<Sampler>(uv0 + pres * mid, zinc * (mid + 1.0))) {
+						hi = mid;
+					} else {
+						lo = mid;
+					}
+				}
+				return 0.5 * (lo + hi);
+			}
+			// picks the sampler of depth_tex once per fragment instead of switching on its modes at every step
+			// trilinear & anisotropic textures are sampled bilinearly from the base level, as by sample()
+			template <uv_clamp_mode Wrap> rtt2_float _march_wrapped(const vec2 &uv0, const vec2 &pres, rtt2_float zinc) const {
+				if (depth_tex->mode_sample == sample_mode::nearest) {
+					return _march<texture_sampler<Wrap, sample_mode::nearest>>(uv0, pres, zinc);
+				}
+				return _march<texture_sampler<Wrap, sample_mode::bilinear>>(uv0, pres, zinc);
+			}
+			rtt2_float _march_any(const vec2 &uv0, const vec2 &pres, rtt2_float zinc) const {
+				if (depth_tex->mode_uv == uv_clamp_mode::repeat) {
+					return _march_wrapped<uv_clamp_mode::repeat>(uv0, pres, zinc);
+				}
+				if (depth_tex->mode_uv == uv_clamp_mode::repeat_border) {
+					return _march_wrapped<uv_clamp_mode::repeat_border>(uv0, pres, zinc);
+				}
+				return _march_wrapped<uv_clamp_mode::rev_repeat>(uv0, pres, zinc);
+			}
 		public:
+			// the march only moves away from the viewer
+			rtt2_float get_depth_bound(const rasterizer&, const rasterizer::frag_info &fi, const void*) const override {
+				return fi.z_cache;
+			}
 			size_t get_additional_face_data_size() const override {
 				return sizeof(_vertex_data);
 			}
@@ -39,37 +222,39 @@ namespace rtt2 {
 				solve_parallelogram_2(vd->uvd12, vd->uvd13, vec2(0.0, 1.0), pv, qv);
 				vd->uvdy = vd->diff12 * pv + vd->diff13 * qv;
 			}
-			bool before_test_shader(const rasterizer &rast, rasterizer::frag_info &fi, rtt2_float*, unsigned char*, void *tag) const override {
+			bool before_test_shader(
+				const rasterizer &rast, rasterizer::frag_info &fi, const mat4 &mdlv, rtt2_float*, unsigned char*, void *tag
+			) const override {
 				_vertex_data *vd = static_cast<_vertex_data*>(tag);
-				vec3 fpos = fi.pos3_cache;
+				vec3 diff12, diff13, uvdx, uvdy;
+				transform_default(mdlv, vd->diff12, diff12, 0.0);
+				transform_default(mdlv, vd->diff13, diff13, 0.0);
+				transform_default(mdlv, vd->uvdx, uvdx, 0.0);
+				transform_default(mdlv, vd->uvdy, uvdy, 0.0);
+				vec3 fpos = ((*rast.mat_proj)[3][3] == 0.0 ? fi.pos3_cache : vec3(0.0, 0.0, -1.0)); // orthographic views look along -z
 				fpos.set_length(1.0);
 				rtt2_float sinv = -vec3::dot(fi.normal_cache, fpos), invcosv = 1.0 / std::sqrt(1.0 - sinv * sinv);
 				vec3 xd = (fpos + sinv * fi.normal_cache) * invcosv;
 				rtt2_float zinc = sinv * invcosv;
 				rtt2_float p, q;
-				solve_parallelogram_3(vd->diff12, vd->diff13, xd, p, q);
+				solve_parallelogram_3(diff12, diff13, xd, p, q);
 				vec2 pres = p * vd->uvd12 + q * vd->uvd13;
 				rtt2_float invlv = 0.5 / (pres.length() * depth_tex->get_w());
 				zinc *= invlv;
 				pres *= invlv;
-				rtt2_float zv = zinc, posmult = invlv * invcosv;
-				for (size_t i = 0; i < 200; ++i, fi.uv_cache += pres, fi.pos3_cache += fpos * posmult, zv += zinc) {
-					color_vec v;
-					sample(*depth_tex, fi.uv_cache, v);
-					if ((1.0 - v.x) * depth < zv) {
-						break;
-					}
-				}
+				rtt2_float t = _march_any(fi.uv_cache, pres, zinc);
+				fi.uv_cache += pres * t;
+				fi.pos3_cache += fpos * (invlv * invcosv * t);
 				fi.pos4_cache = *rast.mat_proj * vec4(fi.pos3_cache);
 				fi.z_cache = fi.pos4_cache.z / fi.pos4_cache.w;
 
 				color_vec gradx, grady;
 				depth_tex->grad_x(fi.uv_cache, gradx);
 				depth_tex->grad_y(fi.uv_cache, grady);
-				rtt2_float uvdxlsq = vd->uvdx.sqr_length(), uvdylsq = vd->uvdy.sqr_length();
+				rtt2_float uvdxlsq = uvdx.sqr_length(), uvdylsq = uvdy.sqr_length();
 				rtt2_float gx = -depth * gradx.x * depth_tex->get_w() / uvdxlsq, gy = -depth * grady.x * depth_tex->get_h() / uvdylsq;
 				rtt2_float zmult = std::sqrt(1.0 / (1.0 + gx * gx * uvdxlsq + gy * gy * uvdylsq));
-				fi.normal_cache = (fi.normal_cache + vd->uvdx * gx + vd->uvdy * gy) * zmult;
+				fi.normal_cache = (fi.normal_cache + uvdx * gx + uvdy * gy) * zmult;
 
 				return true;
 			}
@@ -10,6 +10,7 @@ namespace rtt2 {
 		struct light_data;
 		class rasterizer;
 		class basic_renderer;
+		enum class model_selection;
 
 		union light_cache {
 			struct {
@@ -23,96 +24,334 @@ namespace rtt2 {
 				rtt2_float inner_cosv, outer_cosv;
 			} of_spotlight;
 		};
+		// the built-in light types are final, since the batched paths call them directly by their type
+		enum class light_type {
+			point,
+			directional,
+			spot,
+			other // a type defined elsewhere, which is only lit through the virtual functions of light_data
+		};
+		enum class shadow_filter_mode {
+			nearest, // a single depth test
+			pcf, // the fraction of passed depth tests in a kernel of (2 * radius + 1) ^ 2 texels, filtered bilinearly
+			exponential // the maps are turned into blurred exponential shadow maps after rendering, and read with one bilinear fetch
+		};
+		struct shadow_filter {
+			constexpr static size_t max_pcf_radius = 7;
+
+			shadow_filter_mode mode;
+			size_t radius; // of the pcf kernel, or of the blur of exponential shadow maps, in texels
+			rtt2_float exponent; // of exponential shadow maps; higher values leak less light, but mustn't exceed 80
+		};
 		union shadow_settings {
 			struct {
 				rtt2_float tolerance, znear, zfar;
+				shadow_filter filter;
 			} of_spotlight;
 			struct {
 				rtt2_float tolerance, znear, zfar;
+				shadow_filter filter;
 			} of_pointlight;
+			struct {
+				rtt2_float tolerance;
+				size_t cascades; // at most light::max_cascades
+				rtt2_float split_lambda; // 0: uniform splits, 1: logarithmic splits
+				rtt2_float hori_fov, aspect_ratio, znear, zfar; // the part of the camera frustum that's covered
+				shadow_filter filter;
+			} of_directional;
 		};
 
+		// the depth of the nearest occluder in either layer of a shadow map; there's no dynamic layer when
+		// dyn.depth_arr is nullptr
+		inline rtt2_float get_shadow_depth(const buffer_set &buff, const buffer_set &dyn, size_t x, size_t y) {
+			rtt2_float z = *buff.get_at(x, y, buff.depth_arr);
+			return (dyn.depth_arr ? std::max(z, *dyn.get_at(x, y, dyn.depth_arr)) : z);
+		}
+		// maps a depth in a shadow map rendered with proj linearly to [0, 1], from the far plane to the near plane
+		inline rtt2_float get_linear_shadow_depth(const mat4 &proj, rtt2_float z) {
+			rtt2_float
+				vz = (proj[3][2] - z * proj[3][3]) / (z * proj[2][3] - proj[2][2]),
+				vnear = -proj[3][2] / proj[2][2],
+				vfar = (proj[3][2] + proj[3][3]) / (-proj[2][3] - proj[2][2]);
+			return (vz - vfar) / (vnear - vfar);
+		}
+		// the depths of the footprint are gathered a row at a time, and then compared & weighted without branches
+		// radius is clamped to shadow_filter::max_pcf_radius, which sizes the footprint arrays
+		inline rtt2_float get_pcf_visibility(const buffer_set &buff, const buffer_set &dyn, size_t radius, const vec2 &xy, rtt2_float zv, rtt2_float tol) {
+			constexpr size_t max_n = 2 * shadow_filter::max_pcf_radius + 2;
+			if (radius > shadow_filter::max_pcf_radius) {
+				radius = shadow_filter::max_pcf_radius;
+			}
+			vec2 cxy = xy; // taps beyond the edges are clamped anyway; this also keeps huge & nan coordinates out of the int conversion
+			clamp_vec(cxy, vec2(-1.0 - radius, -1.0 - radius), vec2(static_cast<rtt2_float>(buff.w + radius), static_cast<rtt2_float>(buff.h + radius)));
+			rtt2_float fx = cxy.x - 0.5, fy = cxy.y - 0.5;
+			int x0 = static_cast<int>(std::floor(fx)) - static_cast<int>(radius), y0 = static_cast<int>(std::floor(fy)) - static_cast<int>(radius);
+			fx -= std::floor(fx);
+			fy -= std::floor(fy);
+			size_t n = 2 * radius + 2, xs[max_n];
+			rtt2_float wx[max_n], d[max_n], sum = 0.0;
+			for (size_t i = 0; i < n; ++i) {
+				xs[i] = static_cast<size_t>(clamp<int>(x0 + static_cast<int>(i), 0, static_cast<int>(buff.w) - 1));
+				wx[i] = 1.0;
+			}
+			wx[0] = 1.0 - fx;
+			wx[n - 1] = fx;
+			for (size_t j = 0; j < n; ++j) {
+				size_t y = static_cast<size_t>(clamp<int>(y0 + static_cast<int>(j), 0, static_cast<int>(buff.h) - 1));
+				for (size_t i = 0; i < n; ++i) {
+					d[i] = get_shadow_depth(buff, dyn, xs[i], y);
+				}
+				rtt2_float row = 0.0;
+				for (size_t i = 0; i < n; ++i) {
+					row += (zv < d[i] - tol ? 0.0 : wx[i]);
+				}
+				sum += row * (j == 0 ? 1.0 - fy : (j == n - 1 ? fy : 1.0));
+			}
+			return sum / static_cast<rtt2_float>((2 * radius + 1) * (2 * radius + 1));
+		}
+		// the filtered moment of an exponential shadow map at xy
+		inline rtt2_float get_shadow_moment(const buffer_set &buff, const vec2 &xy) {
+			vec2 cxy = xy; // as in get_pcf_visibility()
+			clamp_vec(cxy, vec2(-1.0, -1.0), vec2(static_cast<rtt2_float>(buff.w), static_cast<rtt2_float>(buff.h)));
+			rtt2_float fx = cxy.x - 0.5, fy = cxy.y - 0.5;
+			int x = static_cast<int>(std::floor(fx)), y = static_cast<int>(std::floor(fy));
+			fx -= x;
+			fy -= y;
+			size_t
+				xa = static_cast<size_t>(clamp<int>(x, 0, static_cast<int>(buff.w) - 1)),
+				xb = static_cast<size_t>(clamp<int>(x + 1, 0, static_cast<int>(buff.w) - 1)),
+				ya = static_cast<size_t>(clamp<int>(y, 0, static_cast<int>(buff.h) - 1)),
+				yb = static_cast<size_t>(clamp<int>(y + 1, 0, static_cast<int>(buff.h) - 1));
+			rtt2_float
+				m0 = *buff.get_at(xa, ya, buff.depth_arr), m1 = *buff.get_at(xb, ya, buff.depth_arr),
+				m2 = *buff.get_at(xa, yb, buff.depth_arr), m3 = *buff.get_at(xb, yb, buff.depth_arr);
+			return m0 + (m1 - m0) * fx + (m2 - m0 + (m3 - m2 - m1 + m0) * fx) * fy;
+		}
+		// the fraction of light that reaches a point at depth zv, where xy is its position in the shadow map in pixels
+		// the shadow map is rendered with proj, and tol is subtracted from the depths of its occluders
+		inline rtt2_float get_shadow_visibility(
+			const buffer_set &buff, const buffer_set &dyn, const shadow_filter &f, const mat4 &proj,
+			const vec2 &xy, rtt2_float zv, rtt2_float tol
+		) {
+			if (zv <= -1.0) {
+				return 1.0;
+			}
+			if (f.mode == shadow_filter_mode::pcf) {
+				return get_pcf_visibility(buff, dyn, f.radius, xy, zv, tol);
+			}
+			if (f.mode == shadow_filter_mode::exponential) {
+				rtt2_float m = get_shadow_moment(buff, xy);
+				if (dyn.depth_arr) {
+					m = std::min(m, get_shadow_moment(dyn, xy));
+				}
+				return std::min<rtt2_float>(1.0, m * std::exp(f.exponent * get_linear_shadow_depth(proj, zv + tol)));
+			}
+			size_t
+				x = static_cast<size_t>(clamp<rtt2_float>(xy.x, 0.5, buff.w - 0.5)),
+				y = static_cast<size_t>(clamp<rtt2_float>(xy.y, 0.5, buff.h - 0.5));
+			return (zv < get_shadow_depth(buff, dyn, x, y) - tol ? 0.0 : 1.0);
+		}
+
+		// roughly the fraction of the screen covered by a sphere, from the angle that it spans
+		inline rtt2_float get_screen_importance(const mat4 &mdlv, const mat4 &proj, const vec3 &center, rtt2_float radius) {
+			vec3 c;
+			transform_default(mdlv, center, c);
+			rtt2_float sqrdist = c.sqr_length();
+			if (sqrdist <= radius * radius) {
+				return 1.0;
+			}
+			if (c.z > radius) {
+				return 0.0;
+			}
+			rtt2_float r = radius * std::max(proj[0][0], proj[1][1]) / std::sqrt(sqrdist - radius * radius);
+			return std::min<rtt2_float>(1.0, 0.25 * RTT2_PI * r * r);
+		}
+
+		// shadow maps are built with an optional dynamic layer: the static models are then drawn into the main buffers
+		// once, and the dynamic ones into the dynamic buffers by refresh_shadow_cache(), which is called every frame
+		// after set_camera_mat()
 		struct light {
 			light() = default;
 			light(const light_data &d) : data(&d) {
 			}
 
+			constexpr static size_t max_cascades = 4; // of a directional light
+
 			const light_data *data = nullptr;
 			bool has_shadow = false;
 			union shadow_data {
 				struct {
-					void set(const mat4 &mv, const mat4 &pj, const buffer_set &buf, rtt2_float tol) {
+					void set(const scene_description &sc, const mat4 &mv, const mat4 &pj, const buffer_set &buf, const buffer_set *dbuf, rtt2_float tol, const shadow_filter &flt) {
+						scene = &sc;
+						mat_view = mv;
+						mat_proj = pj;
 						mat4::mult_ref(pj, mv, mat_w2sm);
 						buff = buf;
+						if (dbuf) {
+							dyn_buff = *dbuf;
+						} else {
+							dyn_buff.set(0, 0, nullptr, nullptr, nullptr);
+						}
 						tolerance = tol;
+						filter = flt;
 					}
 
-					mat4 mat_w2sm, mat_tot;
-					buffer_set buff;
+					mat4 mat_view, mat_proj, mat_w2sm, mat_tot;
+					buffer_set buff, dyn_buff;
+					const scene_description *scene;
 					rtt2_float tolerance;
+					shadow_filter filter;
 				} of_spotlight;
 				struct {
-					void set(const buffer_set *bs, rtt2_float tol) {
+					void set(const scene_description &sc, const buffer_set *bs, const buffer_set *dbs, rtt2_float tol, const shadow_filter &flt) {
+						scene = &sc;
 						std::memcpy(buff, bs, sizeof(buff));
+						for (size_t i = 0; i < 6; ++i) {
+							if (dbs) {
+								dyn_buff[i] = dbs[i];
+							} else {
+								dyn_buff[i].set(0, 0, nullptr, nullptr, nullptr);
+							}
+						}
 						tolerance = tol;
+						filter = flt;
 					}
 
 					mat4 mat_invcam, mat_proj;
-					buffer_set buff[6];
+					buffer_set buff[6], dyn_buff[6];
+					const scene_description *scene;
 					rtt2_float tolerance;
+					shadow_filter filter;
 				} of_pointlight;
+				struct {
+					void set(const scene_description &sc, const buffer_set *bs, const buffer_set *dbs, const shadow_settings &set) {
+						scene = &sc;
+						cascades = set.of_directional.cascades;
+						std::memcpy(buff, bs, sizeof(buffer_set) * cascades);
+						for (size_t i = 0; i < cascades; ++i) {
+							if (dbs) {
+								dyn_buff[i] = dbs[i];
+							} else {
+								dyn_buff[i].set(0, 0, nullptr, nullptr, nullptr);
+							}
+						}
+						std::memset(valid, 0, sizeof(valid));
+						depth_min = INFINITY;
+						depth_max = -INFINITY;
+						casters_hash = 0;
+						tolerance = set.of_directional.tolerance;
+						split_lambda = set.of_directional.split_lambda;
+						hori_fov = set.of_directional.hori_fov;
+						aspect_ratio = set.of_directional.aspect_ratio;
+						znear = set.of_directional.znear;
+						zfar = set.of_directional.zfar;
+						filter = set.of_directional.filter;
+					}
+
+					// cascade i covers view depths up to split_far[i], and its static layer is only rendered again when
+					// mat_w2sm[i] changes
+					// [depth_min, depth_max] is the light-space depth range of all cascades, which casters can move inside
+					// without changing the cascades
+					// casters_hash is a hash of the transforms of the models in the static layers
+					mat4 mat_w2sm[max_cascades], mat_tot[max_cascades], mat_proj[max_cascades];
+					buffer_set buff[max_cascades], dyn_buff[max_cascades];
+					rtt2_float split_far[max_cascades];
+					bool valid[max_cascades];
+					const scene_description *scene;
+					size_t cascades;
+					rtt2_float tolerance, split_lambda, hori_fov, aspect_ratio, znear, zfar, depth_min, depth_max;
+					unsigned long long casters_hash;
+					shadow_filter filter;
+				} of_directional;
 			} shadow_cache;
 			void set_camera_mat(const mat4&);
-			bool in_shadow(const vec3&) const;
-			void build_shadow_cache(const scene_description&, const buffer_set*, const shadow_settings&);
+			rtt2_float get_visibility(const vec3&) const; // 0 when the point is completely in shadow, 1 when it's lit
+			void build_shadow_cache(const scene_description&, const buffer_set*, const shadow_settings&, const buffer_set *dyn = nullptr);
+			void refresh_shadow_cache();
 		};
 
 		struct light_data {
 			virtual ~light_data() {
 			}
 
+			virtual light_type get_type() const {
+				return light_type::other;
+			}
 			virtual void build_cache(const mat4&, light_cache&) const = 0;
 			virtual bool get_illum(const light_cache&, const vec3&, vec3&, color_vec_rgb&) const = 0;
+			// the sphere outside of which the light has no effect, in the space of the cache; false when there's none
+			virtual bool get_bounds(const light_cache&, vec3&, rtt2_float&) const = 0;
 
-			virtual void build_shadow_cache(const scene_description&, const buffer_set*, const shadow_settings&, light::shadow_data&) const = 0;
+			virtual void build_shadow_cache(const scene_description&, const buffer_set*, const buffer_set*, const shadow_settings&, light::shadow_data&) const = 0;
+			virtual void refresh_shadow_cache(light::shadow_data&) const = 0;
 			virtual void set_camera_mat(const mat4&, light::shadow_data&) const = 0;
-			virtual bool in_shadow(const vec3&, const light::shadow_data&) const = 0;
+			// the number of shadow maps that build_shadow_cache() takes, and how much they matter in [0, 1], for a camera
+			// with the given modelview & projection matrices
+			virtual size_t get_shadow_map_count(const shadow_settings&) const = 0;
+			virtual rtt2_float get_shadow_importance(const mat4&, const mat4&, const shadow_settings&) const = 0;
+			virtual rtt2_float get_visibility(const vec3&, const light::shadow_data&) const = 0;
 		};
 
 		inline void light::set_camera_mat(const mat4 &mt) {
 			data->set_camera_mat(mt, shadow_cache);
 		}
-		inline bool light::in_shadow(const vec3 &pt) const {
-			return (has_shadow ? data->in_shadow(pt, shadow_cache) : false);
+		inline rtt2_float light::get_visibility(const vec3 &pt) const {
+			return (has_shadow ? data->get_visibility(pt, shadow_cache) : 1.0);
 		}
-		inline void light::build_shadow_cache(const scene_description &sc, const buffer_set *bs, const shadow_settings &set) {
-			data->build_shadow_cache(sc, bs, set, shadow_cache);
+		inline void light::build_shadow_cache(const scene_description &sc, const buffer_set *bs, const shadow_settings &set, const buffer_set *dyn) {
+			data->build_shadow_cache(sc, bs, dyn, set, shadow_cache);
 			has_shadow = true;
 		}
+		inline void light::refresh_shadow_cache() {
+			if (has_shadow) {
+				data->refresh_shadow_cache(shadow_cache);
+			}
+		}
 
-		struct point_light_data : public light_data {
+		struct point_light_data final : public light_data {
 			point_light_data() = default;
 			point_light_data(const vec3 &p, const color_vec_rgb &c) : pos(p), color(c) {
 			}
 
 			vec3 pos;
 			color_vec_rgb color;
+			rtt2_float range = INFINITY; // points farther away aren't lit
 
+			light_type get_type() const override {
+				return light_type::point;
+			}
 			void build_cache(const mat4 &m, light_cache &res) const override {
 				transform_default(m, pos, res.of_pointlight.pos);
 			}
 			bool get_illum(const light_cache &c, const vec3 &fpos, vec3 &idir, color_vec_rgb &res) const override {
 				idir = fpos - c.of_pointlight.pos;
-				rtt2_float invsql = 1.0 / idir.sqr_length();
+				rtt2_float sql = idir.sqr_length();
+				if (sql > range * range) {
+					return false;
+				}
+				rtt2_float invsql = 1.0 / sql;
 				res = color * invsql;
 				idir *= std::sqrt(invsql);
 				return true;
 			}
-			void build_shadow_cache(const scene_description&, const buffer_set*, const shadow_settings&, light::shadow_data&) const override;
+			bool get_bounds(const light_cache &c, vec3 &center, rtt2_float &radius) const override {
+				center = c.of_pointlight.pos;
+				radius = range;
+				return range < INFINITY;
+			}
+			void build_shadow_cache(const scene_description&, const buffer_set*, const buffer_set*, const shadow_settings&, light::shadow_data&) const override;
+			void refresh_shadow_cache(light::shadow_data&) const override;
 			void set_camera_mat(const mat4 &mt, light::shadow_data &data) const override {
 				mt.get_inversion(data.of_pointlight.mat_invcam);
 			}
-			bool in_shadow(const vec3 &pt, const light::shadow_data &data) const override {
+			size_t get_shadow_map_count(const shadow_settings&) const override {
+				return 6;
+			}
+			rtt2_float get_shadow_importance(const mat4 &mdlv, const mat4 &proj, const shadow_settings &set) const override {
+				return get_screen_importance(mdlv, proj, pos, set.of_pointlight.zfar);
+			}
+			// filtering doesn't cross the edges of the faces
+			rtt2_float get_visibility(const vec3 &pt, const light::shadow_data &data) const override {
 				vec3 t, res;
 				transform_default(data.of_pointlight.mat_invcam, pt, t);
 				t -= pos;
@@ -121,11 +360,10 @@ namespace rtt2 {
 				vec2 xy;
 				cp.homogenize_2(xy);
 				data.of_pointlight.buff[face].denormalize_scr_coord(xy);
-				size_t
-					x = static_cast<size_t>(clamp(xy.x, 0.5, data.of_pointlight.buff[face].w - 0.5)),
-					y = static_cast<size_t>(clamp(xy.y, 0.5, data.of_pointlight.buff[face].h - 0.5));
-				rtt2_float *z = data.of_pointlight.buff[face].get_at(x, y, data.of_pointlight.buff[face].depth_arr), zv = cp.z / cp.w;
-				return zv > -1.0 && zv < *z - data.of_pointlight.tolerance;
+				return get_shadow_visibility(
+					data.of_pointlight.buff[face], data.of_pointlight.dyn_buff[face], data.of_pointlight.filter,
+					data.of_pointlight.mat_proj, xy, cp.z / cp.w, data.of_pointlight.tolerance
+				);
 			}
 			/*     +---+
 			**     | 5 |   0: -z
@@ -200,12 +438,18 @@ namespace rtt2 {
 				m[1][2] = -1.0;
 			}
 		protected:
-			template <size_t Id> static void _build_shadow_cache_face(const buffer_set*, basic_renderer&, mat4&, const mat4&);
+			template <size_t Id> static void _build_shadow_cache_face(
+				const scene_description&, const buffer_set*, const std::vector<soa_vec3f>&, const mat4&, const mat4&, model_selection
+			);
+			void _build_shadow_layer(const scene_description&, const buffer_set*, const mat4&, model_selection, const shadow_filter&) const;
 		};
-		struct directional_light_data : public light_data {
+		struct directional_light_data final : public light_data {
 			vec3 dir;
 			color_vec_rgb color;
 
+			light_type get_type() const override {
+				return light_type::directional;
+			}
 			void build_cache(const mat4 &m, light_cache &c) const override {
 				transform_default(m, dir, c.of_directional.dir, 0.0);
 				c.of_directional.dir.set_length(1.0);
@@ -215,12 +459,57 @@ namespace rtt2 {
 				res = color;
 				return true;
 			}
+			bool get_bounds(const light_cache&, vec3&, rtt2_float&) const override {
+				return false;
+			}
+
+			// cascaded shadow maps; the cascades are fitted to the camera & rendered in set_camera_mat()
+			void build_shadow_cache(const scene_description&, const buffer_set*, const buffer_set*, const shadow_settings&, light::shadow_data&) const override;
+			void refresh_shadow_cache(light::shadow_data&) const override;
+			void set_camera_mat(const mat4&, light::shadow_data&) const override;
+			size_t get_shadow_map_count(const shadow_settings &set) const override {
+				return set.of_directional.cascades;
+			}
+			rtt2_float get_shadow_importance(const mat4&, const mat4&, const shadow_settings&) const override {
+				return 1.0;
+			}
+			rtt2_float get_visibility(const vec3 &pt, const light::shadow_data &data) const override {
+				size_t i = 0;
+				for (; i < data.of_directional.cascades && -pt.z > data.of_directional.split_far[i]; ++i) {
+				}
+				if (i == data.of_directional.cascades) {
+					return 1.0;
+				}
+				const buffer_set &buff = data.of_directional.buff[i];
+				vec4 cp = data.of_directional.mat_tot[i] * vec4(pt);
+				vec2 xy;
+				cp.homogenize_2(xy);
+				buff.denormalize_scr_coord(xy);
+				return get_shadow_visibility(
+					buff, data.of_directional.dyn_buff[i], data.of_directional.filter,
+					data.of_directional.mat_proj[i], xy, cp.z / cp.w, data.of_directional.tolerance
+				);
+			}
+
+			// the light's view transform, with the origin at the world origin
+			void get_view_mat(mat4 &res) const {
+				vec3 ndir(dir), up, right;
+				ndir.set_length(1.0);
+				ndir.get_max_prp(up);
+				up.set_length(1.0);
+				vec3::cross_ref(ndir, up, right);
+				get_trans_camview_3(vec3(0.0, 0.0, 0.0), ndir, up, right, res);
+			}
 		};
-		struct spot_light_data : public light_data {
+		struct spot_light_data final : public light_data {
 			vec3 pos, dir;
 			color_vec_rgb color;
 			rtt2_float inner_angle, outer_angle;
+			rtt2_float range = INFINITY; // points farther away aren't lit
 
+			light_type get_type() const override {
+				return light_type::spot;
+			}
 			void build_cache(const mat4 &m, light_cache &c) const override {
 				transform_default(m, pos, c.of_spotlight.pos);
 				transform_default(m, dir, c.of_spotlight.dir, 0.0);
@@ -230,33 +519,59 @@ namespace rtt2 {
 			}
 			bool get_illum(const light_cache &c, const vec3 &fpos, vec3 &rdir, color_vec_rgb &res) const override {
 				rdir = fpos - c.of_spotlight.pos;
-				rtt2_float invsql = 1.0 / rdir.sqr_length();;
+				rtt2_float sql = rdir.sqr_length();
+				if (sql > range * range) {
+					return false;
+				}
+				rtt2_float invsql = 1.0 / sql;
 				rdir *= std::sqrt(invsql);
 				rtt2_float dotv = vec3::dot(rdir, c.of_spotlight.dir);
 				if (dotv < c.of_spotlight.outer_cosv) {
 					return false;
 				}
-				rtt2_float mult = std::min(1.0, (dotv - c.of_spotlight.outer_cosv) / (c.of_spotlight.inner_cosv - c.of_spotlight.outer_cosv));
+				rtt2_float mult = std::min<rtt2_float>(1.0, (dotv - c.of_spotlight.outer_cosv) / (c.of_spotlight.inner_cosv - c.of_spotlight.outer_cosv));
 				res = color * invsql * mult;
 				return true;
 			}
+			// the sphere around the cone, or around the whole range when that's smaller
+			bool get_bounds(const light_cache &c, vec3 &center, rtt2_float &radius) const override {
+				rtt2_float half = 0.5 * range, r = range * std::tan(outer_angle);
+				radius = std::sqrt(half * half + r * r);
+				if (outer_angle < 0.5 * RTT2_PI && radius < range) {
+					center = c.of_spotlight.pos + c.of_spotlight.dir * half;
+				} else {
+					center = c.of_spotlight.pos;
+					radius = range;
+				}
+				return range < INFINITY;
+			}
 
-			void build_shadow_cache(const scene_description&, const buffer_set*, const shadow_settings&, light::shadow_data&) const override;
+			void build_shadow_cache(const scene_description&, const buffer_set*, const buffer_set*, const shadow_settings&, light::shadow_data&) const override;
+			void refresh_shadow_cache(light::shadow_data&) const override;
 			void set_camera_mat(const mat4 &mt, light::shadow_data &data) const override {
 				mat4 inv;
 				mt.get_inversion(inv);
 				mat4::mult_ref(data.of_spotlight.mat_w2sm, inv, data.of_spotlight.mat_tot);
 			}
-			bool in_shadow(const vec3 &pt, const light::shadow_data &data) const override {
+			size_t get_shadow_map_count(const shadow_settings&) const override {
+				return 1;
+			}
+			// the sphere around the cone of the light
+			rtt2_float get_shadow_importance(const mat4 &mdlv, const mat4 &proj, const shadow_settings &set) const override {
+				rtt2_float half = 0.5 * set.of_spotlight.zfar, r = set.of_spotlight.zfar * std::tan(outer_angle);
+				vec3 ndir(dir);
+				ndir.set_length(1.0);
+				return get_screen_importance(mdlv, proj, pos + ndir * half, std::sqrt(half * half + r * r));
+			}
+			rtt2_float get_visibility(const vec3 &pt, const light::shadow_data &data) const override {
 				vec4 cp = data.of_spotlight.mat_tot * vec4(pt);
 				vec2 xy;
 				cp.homogenize_2(xy);
 				data.of_spotlight.buff.denormalize_scr_coord(xy);
-				size_t
-					x = static_cast<size_t>(clamp(xy.x, 0.5, data.of_spotlight.buff.w - 0.5)),
-					y = static_cast<size_t>(clamp(xy.y, 0.5, data.of_spotlight.buff.h - 0.5));
-				rtt2_float *z = data.of_spotlight.buff.get_at(x, y, data.of_spotlight.buff.depth_arr), zv = cp.z / cp.w;
-				return zv > -1.0 && zv < *z - data.of_spotlight.tolerance;
+				return get_shadow_visibility(
+					data.of_spotlight.buff, data.of_spotlight.dyn_buff, data.of_spotlight.filter,
+					data.of_spotlight.mat_proj, xy, cp.z / cp.w, data.of_spotlight.tolerance
+				);
 			}
 		};
 	}
@@ -3,6 +3,7 @@
 #include <utility>
 #include <cstring>
 #include <exception>
+#include <vector>
 
 #include "vec.h"
 #include "utils.h"
@@ -20,6 +21,20 @@ namespace rtt2 {
 			return val[x];
 		}
 
+		bool operator ==(const sqrmat &rhs) const {
+			for (size_t x = 0; x < Dim; ++x) {
+				for (size_t y = 0; y < Dim; ++y) {
+					if (val[x][y] != rhs.val[x][y]) {
+						return false;
+					}
+				}
+			}
+			return true;
+		}
+		bool operator !=(const sqrmat &rhs) const {
+			return !(*this == rhs);
+		}
+
 		void transpose_in_place() {
 			for (size_t y = 1; y < Dim; ++y) {
 				for (size_t x = 0; x < y; ++x) {
@@ -305,6 +320,69 @@ namespace rtt2 {
 		res.z = mt[0][2] * v.x + mt[1][2] * v.y + mt[2][2] * v.z + mt[3][2] * w;
 	}
 
+	// vec3s stored as separate coordinate arrays, so that consecutive vectors can be processed together
+	template <typename T> struct soa_vec3 {
+		std::vector<T> x, y, z;
+
+		size_t size() const {
+			return x.size();
+		}
+		void clear() {
+			x.clear();
+			y.clear();
+			z.clear();
+		}
+		void resize(size_t sz) {
+			x.resize(sz);
+			y.resize(sz);
+			z.resize(sz);
+		}
+		void push_back(const vec3 &v) {
+			x.push_back(static_cast<T>(v.x));
+			y.push_back(static_cast<T>(v.y));
+			z.push_back(static_cast<T>(v.z));
+		}
+		vec3 get_at(size_t id) const {
+			return vec3(x[id], y[id], z[id]);
+		}
+	};
+	typedef soa_vec3<float> soa_vec3f;
+
+	// the same as calling transform_default() on each of the n vectors, with the results computed in U
+	// the loops have no dependencies between iterations, so that they can be vectorized by the compiler
+	template <typename T, typename U> inline void transform_batch(
+		const mat4 &mt, const T *x, const T *y, const T *z, size_t n, U *rx, U *ry, U *rz, rtt2_float w = 1.0
+	) {
+		const U
+			m00 = static_cast<U>(mt[0][0]), m10 = static_cast<U>(mt[1][0]), m20 = static_cast<U>(mt[2][0]),
+			m01 = static_cast<U>(mt[0][1]), m11 = static_cast<U>(mt[1][1]), m21 = static_cast<U>(mt[2][1]),
+			m02 = static_cast<U>(mt[0][2]), m12 = static_cast<U>(mt[1][2]), m22 = static_cast<U>(mt[2][2]),
+			m30 = static_cast<U>(mt[3][0] * w), m31 = static_cast<U>(mt[3][1] * w), m32 = static_cast<U>(mt[3][2] * w);
+		for (size_t i = 0; i < n; ++i) {
+			U vx = static_cast<U>(x[i]), vy = static_cast<U>(y[i]), vz = static_cast<U>(z[i]);
+			rx[i] = m00 * vx + m10 * vy + m20 * vz + m30;
+			ry[i] = m01 * vx + m11 * vy + m21 * vz + m31;
+			rz[i] = m02 * vx + m12 * vy + m22 * vz + m32;
+		}
+	}
+	// the same as mt * vec4(v) for each of the n vectors
+	template <typename T, typename U> inline void transform_batch(
+		const mat4 &mt, const T *x, const T *y, const T *z, size_t n, U *rx, U *ry, U *rz, U *rw
+	) {
+		transform_batch(mt, x, y, z, n, rx, ry, rz);
+		const U
+			m03 = static_cast<U>(mt[0][3]), m13 = static_cast<U>(mt[1][3]),
+			m23 = static_cast<U>(mt[2][3]), m33 = static_cast<U>(mt[3][3]);
+		for (size_t i = 0; i < n; ++i) {
+			rw[i] = m03 * static_cast<U>(x[i]) + m13 * static_cast<U>(y[i]) + m23 * static_cast<U>(z[i]) + m33;
+		}
+	}
+	template <typename T, typename U> inline void transform_batch(
+		const mat4 &mt, const soa_vec3<T> &v, size_t beg, size_t n, U *rx, U *ry, U *rz, rtt2_float w = 1.0
+	) {
+		transform_batch(mt, v.x.data() + beg, v.y.data() + beg, v.z.data() + beg, n, rx, ry, rz, w);
+	}
+
 	inline void make_mat2_from_vec2s(const vec2 &c1, const vec2 &c2, mat2 &mat) {
 		std::memcpy(mat[0], &c1, sizeof(vec2));
 		std::memcpy(mat[1], &c2, sizeof(vec2));
@@ -420,6 +498,70 @@ namespace rtt2 {
 		}
 	};
 
+	struct aabb3 {
+		vec3 min, max;
+
+		void set_empty() {
+			min = vec3(INFINITY, INFINITY, INFINITY);
+			max = vec3(-INFINITY, -INFINITY, -INFINITY);
+		}
+		void extend(const vec3 &p) {
+			min_vec(min, p);
+			max_vec(max, p);
+		}
+	};
+	// the homogeneous position of the eye of a projection: the point mapped to x = y = w = 0, on the near side of it
+	// (0, 0, 0, k) for perspective projections, and a direction (0, 0, k, 0) for orthographic ones
+	inline vec4 get_projection_eye(const mat4 &proj) {
+		vec4
+			a(proj[0][0], proj[1][0], proj[2][0], proj[3][0]),
+			b(proj[0][1], proj[1][1], proj[2][1], proj[3][1]),
+			c(proj[0][3], proj[1][3], proj[2][3], proj[3][3]),
+			res(
+				mat3::get_det_3(a.y, a.z, a.w, b.y, b.z, b.w, c.y, c.z, c.w),
+				-mat3::get_det_3(a.x, a.z, a.w, b.x, b.z, b.w, c.x, c.z, c.w),
+				mat3::get_det_3(a.x, a.y, a.w, b.x, b.y, b.w, c.x, c.y, c.w),
+				-mat3::get_det_3(a.x, a.y, a.z, b.x, b.y, b.z, c.x, c.y, c.z)
+			);
+		if (proj[0][2] * res.x + proj[1][2] * res.y + proj[2][2] * res.z + proj[3][2] * res.w < 0.0) {
+			res = -res;
+		}
+		return res;
+	}
+	// planes of the view frustum in the space before the given transformation
+	// a point p is inside a plane when dot(plane, vec4(p)) >= 0; the order matches rasterizing::vertex_pos_cache::get_clip_code
+	struct frustum {
+		vec4 planes[6];
+
+		void set(const mat4 &clip) {
+			vec4
+				r0(clip[0][0], clip[1][0], clip[2][0], clip[3][0]),
+				r1(clip[0][1], clip[1][1], clip[2][1], clip[3][1]),
+				r2(clip[0][2], clip[1][2], clip[2][2], clip[3][2]),
+				r3(clip[0][3], clip[1][3], clip[2][3], clip[3][3]);
+			planes[0] = r3 + r0;
+			planes[1] = r3 - r0;
+			planes[2] = r3 + r1;
+			planes[3] = r3 - r1;
+			planes[4] = -r2;
+			planes[5] = r3 + r2;
+		}
+
+		bool is_outside(const aabb3 &box) const {
+			for (size_t i = 0; i < 6; ++i) {
+				const vec4 &p = planes[i];
+				if (
+					p.x * (p.x > 0.0 ? box.max.x : box.min.x) +
+					p.y * (p.y > 0.0 ? box.max.y : box.min.y) +
+					p.z * (p.z > 0.0 ? box.max.z : box.min.z) + p.w < 0.0
+				) {
+					return true;
+				}
+			}
+			return false;
+		}
+	};
+
 	inline void get_trans_pts_to_pts_3(
 		const vec3 &pf1, const vec3 &pf2, const vec3 &pf3, const vec3 &pf4,
 		const vec3 &pt1, const vec3 &pt2, const vec3 &pt3, const vec3 &pt4,
@@ -472,4 +614,16 @@ namespace rtt2 {
 	inline void get_trans_frustrum_3(const camera &cam, mat4 &res) {
 		get_trans_frustrum_3(cam.hori_fov, cam.aspect_ratio, cam.znear, cam.zfar, res);
 	}
+	// maps the box to x, y in [-1, 1] and z in [-1, 0], with z = -znear at 0 like get_trans_frustrum_3
+	inline void get_trans_orthographic_3(
+		rtt2_float left, rtt2_float right, rtt2_float bottom, rtt2_float top, rtt2_float znear, rtt2_float zfar, mat4 &res
+	) {
+		res.set_identity();
+		res[0][0] = 2.0 / (right - left);
+		res[1][1] = 2.0 / (top - bottom);
+		res[2][2] = 1.0 / (zfar - znear);
+		res[3][0] = -(right + left) / (right - left);
+		res[3][1] = -(top + bottom) / (top - bottom);
+		res[3][2] = znear / (zfar - znear);
+	}
 }
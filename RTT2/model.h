@@ -2,8 +2,11 @@
 
 #include <vector>
 #include <sstream>
+#include <map>
+#include <tuple>
 
 #include "vec.h"
+#include "mat.h"
 #include "color.h"
 #include "utils.h"
 
@@ -14,15 +17,86 @@ namespace rtt2 {
 			size_t vertex_ids[3], uv_ids[3], normal_ids[3];
 		};
 
+		struct indexed_vertex {
+			size_t point_id, normal_id, uv_id;
+		};
+		struct indexed_face {
+			size_t vertex_ids[3];
+		};
+		struct index_cache_data {
+			constexpr static size_t cluster_size = 256; // number of consecutive faces that share a bounding box
+
+			std::vector<size_t> points, normals; // ids of the distinct points & normals that are referenced by faces
+			std::vector<indexed_vertex> vertices; // point & normal ids index the arrays above, uv ids index model_data::uvs
+			std::vector<indexed_face> faces; // in the same order as model_data::faces
+			soa_vec3f point_coords; // float copies of the points above, in the same order
+			aabb3 bounds;
+			std::vector<aabb3> cluster_bounds;
+
+			void clear() {
+				points.clear();
+				normals.clear();
+				vertices.clear();
+				faces.clear();
+				point_coords.clear();
+				bounds.set_empty();
+				cluster_bounds.clear();
+			}
+		};
+
 		std::vector<vec3> points, normals;
 		std::vector<vec2> uvs;
 		std::vector<face_info> faces;
+		index_cache_data index_cache;
 
 		void clear() {
 			points.clear();
 			normals.clear();
 			uvs.clear();
 			faces.clear();
+			index_cache.clear();
+		}
+
+		// must be called again whenever the geometry changes
+		void make_index_cache() {
+			std::map<std::tuple<rtt2_float, rtt2_float, rtt2_float>, size_t> pmap, nmap;
+			std::map<std::pair<rtt2_float, rtt2_float>, size_t> uvmap;
+			std::map<std::tuple<size_t, size_t, size_t>, size_t> vmap;
+			std::vector<size_t> uvids;
+			index_cache.clear();
+			for (auto i = faces.begin(); i != faces.end(); ++i) {
+				indexed_face f;
+				for (size_t d = 0; d < 3; ++d) {
+					const vec3 &p = points[i->vertex_ids[d]], &n = normals[i->normal_ids[d]];
+					const vec2 &uv = uvs[i->uv_ids[d]];
+					indexed_vertex v;
+					v.point_id = _get_distinct_id(pmap, std::make_tuple(p.x, p.y, p.z), i->vertex_ids[d], index_cache.points);
+					v.normal_id = _get_distinct_id(nmap, std::make_tuple(n.x, n.y, n.z), i->normal_ids[d], index_cache.normals);
+					v.uv_id = uvids[_get_distinct_id(uvmap, std::make_pair(uv.x, uv.y), i->uv_ids[d], uvids)];
+					auto res = vmap.insert(std::make_pair(std::make_tuple(v.point_id, v.normal_id, v.uv_id), index_cache.vertices.size()));
+					if (res.second) {
+						index_cache.vertices.push_back(v);
+					}
+					f.vertex_ids[d] = res.first->second;
+				}
+				index_cache.faces.push_back(f);
+			}
+			for (auto i = index_cache.points.begin(); i != index_cache.points.end(); ++i) {
+				index_cache.point_coords.push_back(points[*i]);
+			}
+			for (size_t i = 0; i < faces.size(); ++i) {
+				if (i % index_cache_data::cluster_size == 0) {
+					index_cache.cluster_bounds.push_back(aabb3());
+					index_cache.cluster_bounds.back().set_empty();
+				}
+				for (size_t d = 0; d < 3; ++d) {
+					index_cache.cluster_bounds.back().extend(points[faces[i].vertex_ids[d]]);
+				}
+			}
+			for (auto i = index_cache.cluster_bounds.begin(); i != index_cache.cluster_bounds.end(); ++i) {
+				index_cache.bounds.extend(i->min);
+				index_cache.bounds.extend(i->max);
+			}
 		}
 
 		void make_ball(rtt2_float radius) { // TODO use indexed vertices & normals
@@ -180,10 +254,24 @@ namespace rtt2 {
 				}
 			}
 		}
+	protected:
+		template <typename K> inline static size_t _get_distinct_id(std::map<K, size_t> &mp, const K &key, size_t id, std::vector<size_t> &ids) {
+			auto res = mp.insert(std::make_pair(key, ids.size()));
+			if (res.second) {
+				ids.push_back(id);
+			}
+			return res.first->second;
+		}
 	};
 
 	namespace rasterizing {
 		class enhancement;
+		// the models that a renderer draws; shadow maps keep static & dynamic casters in separate layers
+		enum class model_selection {
+			all,
+			static_only,
+			dynamic_only
+		};
 		struct model {
 			model() = default;
 			model(
@@ -202,6 +290,18 @@ namespace rtt2 {
 			const texture *tex = nullptr;
 			const enhancement *enhance = nullptr;
 			color_vec color;
+			bool is_static = true; // neither the transform nor the geometry changes after shadow maps are built
+
+			bool in_selection(model_selection sel) const {
+				switch (sel) {
+					case model_selection::static_only:
+						return is_static;
+					case model_selection::dynamic_only:
+						return !is_static;
+					default:
+						return true;
+				}
+			}
 		};
 	}
 	namespace raytracing {
@@ -6,6 +6,7 @@
 
 #include "utils.h"
 #include "vec.h"
+#include "mat.h"
 #include "buffer.h"
 #include "texture.h"
 #include "brdf.h"
@@ -22,6 +23,55 @@ namespace rtt2 {
 				cam_pos = mt * vec4(shaded_pos);
 				cam_pos.homogenize_2(screen_pos);
 			}
+
+			// one bit for each frustum plane that the vertex lies outside of
+			// the side planes can be pushed outwards by a factor to test against a guard band
+			unsigned char get_clip_code(rtt2_float xyscale = 1.0) const {
+				return get_clip_code(cam_pos.x, cam_pos.y, cam_pos.z, cam_pos.w, xyscale);
+			}
+			inline static unsigned char get_clip_code(rtt2_float x, rtt2_float y, rtt2_float z, rtt2_float w, rtt2_float xyscale = 1.0) {
+				rtt2_float xyw = w * xyscale;
+				return static_cast<unsigned char>(
+					(x < -xyw ? 0x01 : 0) | (x > xyw ? 0x02 : 0) |
+					(y < -xyw ? 0x04 : 0) | (y > xyw ? 0x08 : 0) |
+					(z > 0.0 ? 0x10 : 0) | (z < -w ? 0x20 : 0)
+				);
+			}
+		};
+		// the positions of many vertices as separate float arrays, which are transformed in batches, and their clip codes
+		// only used for culling; vertex_pos_cache is then filled in for the vertices that are actually drawn
+		struct vertex_pos_batch_cache {
+			constexpr static size_t batch_size = 64;
+
+			soa_vec3f shaded_pos;
+			std::vector<unsigned char> clip_code;
+
+			size_t size() const {
+				return clip_code.size();
+			}
+			void resize(size_t sz) {
+				shaded_pos.resize(sz);
+				clip_code.resize(sz);
+			}
+
+			// transforms at most batch_size points starting from beg, which are at the same positions in src
+			void set(const mat4 &mview, const mat4 &mproj, const soa_vec3f &src, size_t beg, size_t n) {
+				float *x = shaded_pos.x.data() + beg, *y = shaded_pos.y.data() + beg, *z = shaded_pos.z.data() + beg;
+				rtt2_float cx[batch_size], cy[batch_size], cz[batch_size], cw[batch_size];
+				transform_batch(mview, src, beg, n, x, y, z);
+				transform_batch(mproj, x, y, z, n, cx, cy, cz, cw);
+				for (size_t i = 0; i < n; ++i) {
+					clip_code[beg + i] = vertex_pos_cache::get_clip_code(cx[i], cy[i], cz[i], cw[i]);
+				}
+			}
+
+			vec3 get_shaded_pos(size_t id) const {
+				return shaded_pos.get_at(id);
+			}
+			void get(size_t id, const mat4 &mproj, vertex_pos_cache &res) const {
+				res.shaded_pos = get_shaded_pos(id);
+				res.complete(mproj);
+			}
 		};
 		struct vertex_normal_cache {
 			vec3 shaded_normal;
@@ -43,12 +93,49 @@ namespace rtt2 {
 				for (size_t i = cur_buf.w * cur_buf.h; i > 0; --i, ++cur) {
 					*cur = c;
 				}
+				if (cur_buf.sample_color_arr) {
+					cur = cur_buf.sample_color_arr;
+					for (size_t i = cur_buf.w * cur_buf.h * buffer_set::msaa_samples; i > 0; --i, ++cur) {
+						*cur = c;
+					}
+				}
 			}
 			void clear_depth_buf(rtt2_float v) {
 				rtt2_float *cur = cur_buf.depth_arr;
 				for (size_t i = cur_buf.w * cur_buf.h; i > 0; --i, ++cur) {
 					*cur = v;
 				}
+				if (cur_buf.sample_depth_arr) {
+					cur = cur_buf.sample_depth_arr;
+					for (size_t i = cur_buf.w * cur_buf.h * buffer_set::msaa_samples; i > 0; --i, ++cur) {
+						*cur = v;
+					}
+				}
+			}
+			// averages the samples into the color buffer, and writes the nearest sample into the depth buffer if there is one
+			void resolve_msaa() {
+				const device_color *sc = cur_buf.sample_color_arr;
+				const rtt2_float *sd = cur_buf.sample_depth_arr;
+				for (size_t i = 0; i < cur_buf.w * cur_buf.h; ++i, sc += buffer_set::msaa_samples, sd += buffer_set::msaa_samples) {
+					unsigned int a = 0, r = 0, g = 0, b = 0;
+					rtt2_float d = sd[0];
+					for (size_t s = 0; s < buffer_set::msaa_samples; ++s) {
+						a += sc[s].get_a();
+						r += sc[s].get_r();
+						g += sc[s].get_g();
+						b += sc[s].get_b();
+						d = std::max(d, sd[s]);
+					}
+					cur_buf.color_arr[i].set(
+						static_cast<unsigned char>((a + buffer_set::msaa_samples / 2) / buffer_set::msaa_samples),
+						static_cast<unsigned char>((r + buffer_set::msaa_samples / 2) / buffer_set::msaa_samples),
+						static_cast<unsigned char>((g + buffer_set::msaa_samples / 2) / buffer_set::msaa_samples),
+						static_cast<unsigned char>((b + buffer_set::msaa_samples / 2) / buffer_set::msaa_samples)
+					);
+					if (cur_buf.depth_arr) {
+						cur_buf.depth_arr[i] = d;
+					}
+				}
 			}
 
 			void set_pixel(size_t x, size_t y, const device_color &c) {
@@ -75,12 +162,12 @@ namespace rtt2 {
 				fx -= 0.5;
 				for (size_t cx = static_cast<size_t>(std::max(fx + 0.5, 0.0)); cx <= t; ++cx) {
 #ifdef DEBUG
-					rtt2_float y = fy + k * clamp(cx - fx, 0.0, tx);
+					rtt2_float y = fy + k * clamp<rtt2_float>(cx - fx, 0.0, tx);
 					if (y < 0.0 || y > cur_buf.h) {
 						throw std::range_error("vertical clipping incorrect");
 					}
 #endif
-					set_pixel(cx, static_cast<size_t>(fy + k * clamp(cx - fx, 0.0, tx)), c);
+					set_pixel(cx, static_cast<size_t>(fy + k * clamp<rtt2_float>(cx - fx, 0.0, tx)), c);
 				}
 			}
 			void _draw_line_up(rtt2_float by, rtt2_float bx, rtt2_float ty, rtt2_float invk, const device_color &c) { // handles vertical clipping
@@ -89,12 +176,12 @@ namespace rtt2 {
 				by -= 0.5;
 				for (size_t cy = static_cast<size_t>(std::max(by + 0.5, 0.0)); cy <= t; ++cy) {
 #ifdef DEBUG
-					rtt2_float x = bx + invk * clamp(cy - by, 0.0, ty);
+					rtt2_float x = bx + invk * clamp<rtt2_float>(cy - by, 0.0, ty);
 					if (x < 0.0 || x > cur_buf.w) {
 						throw std::range_error("horizontal clipping incorrect");
 					}
 #endif
-					set_pixel(static_cast<size_t>(bx + invk * clamp(cy - by, 0.0, ty)), cy, c);
+					set_pixel(static_cast<size_t>(bx + invk * clamp<rtt2_float>(cy - by, 0.0, ty)), cy, c);
 				}
 			}
 		public:
@@ -109,11 +196,11 @@ namespace rtt2 {
 				}
 				vec2 diff(pt - pf);
 				if (diff.x < 0.0 ? true : (diff.y < 0.0 ? false : (std::fabs(diff.y) > std::fabs(diff.x)))) { // messy
-					if (clip_line_onedir(pf.x, pf.y, pt.x, pt.y, 0.5, cur_buf.w - 0.5)) {
+					if (clip_line_onedir<rtt2_float>(pf.x, pf.y, pt.x, pt.y, 0.5, cur_buf.w - 0.5)) {
 						_draw_line_up(pf.y, pf.x, pt.y, diff.x / diff.y, c);
 					}
 				} else {
-					if (clip_line_onedir(pf.y, pf.x, pt.y, pt.x, 0.5, cur_buf.h - 0.5)) {
+					if (clip_line_onedir<rtt2_float>(pf.y, pf.x, pt.y, pt.x, 0.5, cur_buf.h - 0.5)) {
 						_draw_line_right(pf.x, pf.y, pt.x, diff.y / diff.x, c);
 					}
 				}
@@ -142,6 +229,7 @@ namespace rtt2 {
 			};
 			struct frag_info {
 				rtt2_float p, q, r;
+				size_t x, y; // the pixel
 				unsigned char stencil;
 				const vertex_info *v;
 				vec2 uv_cache;
@@ -149,6 +237,7 @@ namespace rtt2 {
 				vec4 pos4_cache;
 				rtt2_float z_cache;
 				color_vec color_mult_cache;
+				vec2 duv_dx_cache, duv_dy_cache; // only computed when the triangle is textured
 
 #define RTT2_FRAG_INFO_INTERPOLATE(FIELD) (v[0].FIELD * p + v[1].FIELD * q + v[2].FIELD * r)
 #define RTT2_FRAG_INFO_INTERPOLATE_PTR(FIELD) (*v[0].FIELD * p + *v[1].FIELD * q + *v[2].FIELD * r)
@@ -190,7 +279,7 @@ namespace rtt2 {
 				color_vec tv = info.color_mult_cache;
 				if (tex) {
 					color_vec texv;
-					sample(*tex, info.uv_cache, texv);
+					tex->sample(info.uv_cache, info.duv_dx_cache, info.duv_dy_cache, texv);
 					tv = vec_mult(tv, texv);
 				}
 				clamp_vec(tv, 0.0, 1.0);
@@ -224,7 +313,42 @@ namespace rtt2 {
 
 			typedef void(*triangle_rendering_type)(rasterizer&, const vertex_info*, const vec2*, const texture*, void*);
 
-			inline static void drawmode_full(rasterizer &r, const vertex_info *v, const vec2 *ps, const texture *tex, void *tag) {
+			// calls the shaders & the drawing mode through the function pointers stored in the rasterizer
+			struct dynamic_pipeline {
+				inline static void vertex(const rasterizer &r, const mat4 &mat, const vec3 &pos, const vec3 &n, vec3 &resr, vec3 &resn, void *tag) {
+					r.shader_vtx(r, mat, pos, n, resr, resn, tag);
+				}
+				inline static bool test(const rasterizer &r, frag_info &fi, rtt2_float *z, unsigned char *s, void *tag) {
+					return r.shader_test(r, fi, z, s, tag);
+				}
+				inline static void fragment(const rasterizer &r, const frag_info &fi, const texture *tex, device_color *c, void *tag) {
+					r.shader_frag(r, fi, tex, c, tag);
+				}
+				inline static void triangle(rasterizer &r, const vertex_info *v, const vec2 *ps, const texture *tex, void *tag) {
+					r.mode(r, v, ps, tex, tag);
+				}
+			};
+			// shaders fixed at compile time so that they can be inlined into the scanline loop; always fills triangles
+			template <vertex_shader Vs, test_shader Ts, fragment_shader Fs> struct static_pipeline {
+				inline static void vertex(const rasterizer &r, const mat4 &mat, const vec3 &pos, const vec3 &n, vec3 &resr, vec3 &resn, void *tag) {
+					Vs(r, mat, pos, n, resr, resn, tag);
+				}
+				inline static bool test(const rasterizer &r, frag_info &fi, rtt2_float *z, unsigned char *s, void *tag) {
+					return Ts(r, fi, z, s, tag);
+				}
+				inline static void fragment(const rasterizer &r, const frag_info &fi, const texture *tex, device_color *c, void *tag) {
+					Fs(r, fi, tex, c, tag);
+				}
+				inline static void triangle(rasterizer &r, const vertex_info *v, const vec2 *ps, const texture *tex, void *tag) {
+					drawmode_full<static_pipeline>(r, v, ps, tex, tag);
+				}
+			};
+
+			template <typename Pipeline> inline static void drawmode_full(rasterizer &r, const vertex_info *v, const vec2 *ps, const texture *tex, void *tag) {
+				if (r.cur_buf.has_msaa()) {
+					r._draw_triangle_msaa<Pipeline>(v, ps, tex, tag);
+					return;
+				}
 				const vec2 *pscrp[3]{ ps, ps + 1, ps + 2 };
 				sort3(pscrp, [](const vec2 *a, const vec2 *b) {
 					return a->y < b->y;
@@ -236,16 +360,19 @@ namespace rtt2 {
 				fix_proj_params params;
 				r.get_fix_proj_params(v[0].pos->cam_pos, v[1].pos->cam_pos, v[2].pos->cam_pos, params);
 				if (invk_tm < invk_td) {
-					r._draw_half_triangle_half(pscrp[0]->x, pscrp[0]->y, invk_td, invk_tm, pscrp[1]->y, pscrp[0]->y, params, v, tex, tag);
+					r._draw_half_triangle_half<Pipeline>(pscrp[0]->x, pscrp[0]->y, invk_td, invk_tm, pscrp[1]->y, pscrp[0]->y, params, v, tex, tag);
 				} else {
-					r._draw_half_triangle_half(pscrp[0]->x, pscrp[0]->y, invk_tm, invk_td, pscrp[1]->y, pscrp[0]->y, params, v, tex, tag);
+					r._draw_half_triangle_half<Pipeline>(pscrp[0]->x, pscrp[0]->y, invk_tm, invk_td, pscrp[1]->y, pscrp[0]->y, params, v, tex, tag);
 				}
 				if (invk_td < invk_md) {
-					r._draw_half_triangle_half(pscrp[2]->x, pscrp[2]->y, invk_td, invk_md, pscrp[2]->y, pscrp[1]->y, params, v, tex, tag);
+					r._draw_half_triangle_half<Pipeline>(pscrp[2]->x, pscrp[2]->y, invk_td, invk_md, pscrp[2]->y, pscrp[1]->y, params, v, tex, tag);
 				} else {
-					r._draw_half_triangle_half(pscrp[2]->x, pscrp[2]->y, invk_md, invk_td, pscrp[2]->y, pscrp[1]->y, params, v, tex, tag);
+					r._draw_half_triangle_half<Pipeline>(pscrp[2]->x, pscrp[2]->y, invk_md, invk_td, pscrp[2]->y, pscrp[1]->y, params, v, tex, tag);
 				}
 			}
+			inline static void drawmode_full(rasterizer &r, const vertex_info *v, const vec2 *ps, const texture *tex, void *tag) {
+				drawmode_full<dynamic_pipeline>(r, v, ps, tex, tag);
+			}
 			inline static void drawmode_wireframe(rasterizer &r, const vertex_info *v, const vec2 *ps, const texture*, void*) {
 				if (r.cur_buf.color_arr) {
 					device_color c;
@@ -271,7 +398,7 @@ namespace rtt2 {
 
 			triangle_rendering_type mode = drawmode_full;
 		protected:
-			void _draw_half_triangle_half(
+			template <typename Pipeline> void _draw_half_triangle_half(
 				rtt2_float sx, rtt2_float sy, rtt2_float invk1, rtt2_float invk2, rtt2_float ymin, rtt2_float ymax,
 				const fix_proj_params &params, const vertex_info *v, const texture *tex, void *tag
 			) {
@@ -284,28 +411,181 @@ namespace rtt2 {
 				for (size_t y = miny; y < maxy; ++y, ys += ystep) {
 					rtt2_float diff = y - sy, left = diff * invk1 + sx, right = diff * invk2 + sx;
 					size_t
-						l = static_cast<size_t>(std::max(left, 0.0)),
+						l = static_cast<size_t>(std::max<rtt2_float>(left, 0.0)),
 						r = static_cast<size_t>(clamp<rtt2_float>(right, 0.0, cur_buf.w));
 					rtt2_float xs = (l + 0.5) * xstep - 1.0;
 					_fragment_data frag;
 					_get_fragment_data_at(l, y, frag);
 					for (size_t cx = l; cx < r; ++cx, xs += xstep, frag.incr()) {
 						frag_info fi;
+						fi.x = cx;
+						fi.y = y;
 						fix_proj_tex_mapping(params, xs, ys, fi.p, fi.q);
 						fi.r = 1.0 - fi.p - fi.q;
 						fi.v = v;
 						fi.make_cache();
-						if (shader_test(*this, fi, frag.z, frag.stencil, tag)) {
-							shader_frag(*this, fi, tex, frag.color, tag);
+						if (Pipeline::test(*this, fi, frag.z, frag.stencil, tag)) {
+							if (tex) {
+								_make_uv_derivatives(params, xs, ys, fi);
+							}
+							Pipeline::fragment(*this, fi, tex, frag.color, tag);
 						}
 					}
 				}
 			}
-			void _clip_against_xy(const vec4 &front, const vec4 &back, vec2 &resp) {
-				(front * back.z - back * front.z).homogenize_2(resp);
+			inline static bool _edge_covers(rtt2_float e, bool incl) {
+				return e > 0.0 || (incl && e == 0.0);
+			}
+			// coverage & depth are evaluated for every sample, while the shaders are only run once per pixel
+			// the test shader is run once against the depth at which the fragment would be hidden by all covered samples
+			// and it returns the (possibly displaced) depth of the fragment, which is then offset to every sample
+			template <typename Pipeline> void _draw_triangle_msaa(const vertex_info *v, const vec2 *ps, const texture *tex, void *tag) {
+				rtt2_float area = vec2::cross(ps[1] - ps[0], ps[2] - ps[0]);
+				if (area == 0.0) {
+					return;
+				}
+				// inside when ea * x + eb * y + ec > 0 for all edges, or = 0 on a top or left edge, so that samples on an
+				// edge shared by two triangles are covered by exactly one of them
+				rtt2_float ea[3], eb[3], ec[3];
+				bool incl[3];
+				for (size_t i = 0; i < 3; ++i) {
+					const vec2 &from = ps[i], &to = ps[(i + 1) % 3];
+					rtt2_float sgn = (area > 0.0 ? 1.0 : -1.0);
+					ea[i] = sgn * (from.y - to.y);
+					eb[i] = sgn * (to.x - from.x);
+					ec[i] = sgn * (to.y * from.x - to.x * from.y);
+					incl[i] = (ea[i] > 0.0 || (ea[i] == 0.0 && eb[i] < 0.0)); // the inside is to the right or below
+				}
+				size_t
+					minx = static_cast<size_t>(clamp<rtt2_float>(std::min({ ps[0].x, ps[1].x, ps[2].x }), 0.0, cur_buf.w)),
+					maxx = static_cast<size_t>(clamp<rtt2_float>(std::ceil(std::max({ ps[0].x, ps[1].x, ps[2].x })), 0.0, cur_buf.w)),
+					miny = static_cast<size_t>(clamp<rtt2_float>(std::min({ ps[0].y, ps[1].y, ps[2].y }), 0.0, cur_buf.h)),
+					maxy = static_cast<size_t>(clamp<rtt2_float>(std::ceil(std::max({ ps[0].y, ps[1].y, ps[2].y })), 0.0, cur_buf.h));
+
+				fix_proj_params params;
+				get_fix_proj_params(v[0].pos->cam_pos, v[1].pos->cam_pos, v[2].pos->cam_pos, params);
+				rtt2_float zx, zy, zc;
+				_get_depth_plane(v[0].pos->cam_pos, v[1].pos->cam_pos, v[2].pos->cam_pos, zx, zy, zc);
+				zx *= 2.0 / cur_buf.w;
+				zy *= 2.0 / cur_buf.h;
+				zc -= zx * 0.5 * cur_buf.w + zy * 0.5 * cur_buf.h; // z / w in denormalized screen coordinates
+
+				const vec2 *offsets = buffer_set::get_msaa_offsets();
+				for (size_t y = miny; y < maxy; ++y) {
+					for (size_t x = minx; x < maxx; ++x) {
+						unsigned char mask = 0;
+						vec2 center(0.0, 0.0);
+						size_t count = 0;
+						for (size_t s = 0; s < buffer_set::msaa_samples; ++s) {
+							rtt2_float sx = x + offsets[s].x, sy = y + offsets[s].y;
+							if (
+								_edge_covers(ea[0] * sx + eb[0] * sy + ec[0], incl[0]) &&
+								_edge_covers(ea[1] * sx + eb[1] * sy + ec[1], incl[1]) &&
+								_edge_covers(ea[2] * sx + eb[2] * sy + ec[2], incl[2])
+							) {
+								mask |= static_cast<unsigned char>(1 << s);
+								center += vec2(sx, sy);
+								++count;
+							}
+						}
+						if (mask == 0) {
+							continue;
+						}
+						if (count == buffer_set::msaa_samples) {
+							center = vec2(x + 0.5, y + 0.5);
+						} else { // shade partially covered pixels at the centroid of the covered samples
+							center /= static_cast<rtt2_float>(count);
+						}
+						size_t id = cur_buf.w * y + x;
+						frag_info fi;
+						fi.x = x;
+						fi.y = y;
+						fix_proj_tex_mapping(params, center.x * 2.0 / cur_buf.w - 1.0, center.y * 2.0 / cur_buf.h - 1.0, fi.p, fi.q);
+						fi.r = 1.0 - fi.p - fi.q;
+						fi.v = v;
+						fi.make_cache();
+						rtt2_float *sd = cur_buf.sample_depth_arr + id * buffer_set::msaa_samples, zfrag = INFINITY;
+						for (size_t s = 0; s < buffer_set::msaa_samples; ++s) {
+							if (mask & (1 << s)) {
+								zfrag = std::min(zfrag, sd[s] - (zx * (x + offsets[s].x) + zy * (y + offsets[s].y) + zc));
+							}
+						}
+						rtt2_float zcenter = zx * center.x + zy * center.y + zc;
+						zfrag += zcenter;
+						if (!Pipeline::test(*this, fi, &zfrag, (cur_buf.stencil_arr ? cur_buf.stencil_arr + id : nullptr), tag)) {
+							continue;
+						}
+						zfrag -= zcenter;
+						unsigned char passed = 0;
+						for (size_t s = 0; s < buffer_set::msaa_samples; ++s) {
+							if (mask & (1 << s)) {
+								rtt2_float zs = zx * (x + offsets[s].x) + zy * (y + offsets[s].y) + zc + zfrag;
+								if (zs > sd[s]) {
+									sd[s] = zs;
+									passed |= static_cast<unsigned char>(1 << s);
+								}
+							}
+						}
+						if (passed) {
+							if (tex) {
+								_make_uv_derivatives(params, center.x * 2.0 / cur_buf.w - 1.0, center.y * 2.0 / cur_buf.h - 1.0, fi);
+							}
+							device_color c;
+							Pipeline::fragment(*this, fi, tex, &c, tag);
+							device_color *sc = cur_buf.sample_color_arr + id * buffer_set::msaa_samples;
+							for (size_t s = 0; s < buffer_set::msaa_samples; ++s) {
+								if (passed & (1 << s)) {
+									sc[s] = c;
+								}
+							}
+						}
+					}
+				}
+			}
+			// differences of the uv mapping to the neighbouring pixel centers, as a 2x2 quad would produce
+			// evaluated directly so that the scanlines need not be walked in pairs
+			void _make_uv_derivatives(const fix_proj_params &params, rtt2_float xs, rtt2_float ys, frag_info &fi) const {
+				vec2 uv = *fi.v[0].uv * fi.p + *fi.v[1].uv * fi.q + *fi.v[2].uv * fi.r;
+				rtt2_float p, q;
+				fix_proj_tex_mapping(params, xs + 2.0 / cur_buf.w, ys, p, q);
+				fi.duv_dx_cache = *fi.v[0].uv * p + *fi.v[1].uv * q + *fi.v[2].uv * (1.0 - p - q) - uv;
+				fix_proj_tex_mapping(params, xs, ys + 2.0 / cur_buf.h, p, q);
+				fi.duv_dy_cache = *fi.v[0].uv * p + *fi.v[1].uv * q + *fi.v[2].uv * (1.0 - p - q) - uv;
+			}
+			// z / w = zx * x + zy * y + zc in normalized device coordinates, from the plane in clip space that contains the vertices
+			inline static void _get_depth_plane(const vec4 &p1, const vec4 &p2, const vec4 &p3, rtt2_float &zx, rtt2_float &zy, rtt2_float &zc) {
+				rtt2_float
+					a = mat3::get_det_3(p1.y, p1.z, p1.w, p2.y, p2.z, p2.w, p3.y, p3.z, p3.w),
+					b = -mat3::get_det_3(p1.x, p1.z, p1.w, p2.x, p2.z, p2.w, p3.x, p3.z, p3.w),
+					c = mat3::get_det_3(p1.x, p1.y, p1.w, p2.x, p2.y, p2.w, p3.x, p3.y, p3.w),
+					d = -mat3::get_det_3(p1.x, p1.y, p1.z, p2.x, p2.y, p2.z, p3.x, p3.y, p3.z),
+					invc = -1.0 / c;
+				zx = a * invc;
+				zy = b * invc;
+				zc = d * invc;
+			}
+
+			constexpr static size_t _max_clipped_vertices = 9;
+			// clips the polygon against the plane dot(plane, p) >= 0 and returns the number of vertices left
+			inline static size_t _clip_polygon(const vec4 *in, size_t n, const vec4 &plane, vec4 *out) {
+				size_t res = 0;
+				rtt2_float lastd = vec4::dot(in[n - 1], plane);
+				for (size_t i = 0, last = n - 1; i < n; last = i++) {
+					rtt2_float d = vec4::dot(in[i], plane);
+					if ((d >= 0.0) != (lastd >= 0.0)) {
+						out[res++] = in[last] + (in[i] - in[last]) * (lastd / (lastd - d));
+					}
+					if (d >= 0.0) {
+						out[res++] = in[i];
+					}
+					lastd = d;
+				}
+				return res;
 			}
 		public:
-			void draw_cached_triangle_no_backface_culling(
+			rtt2_float guard_band = 2.0; // triangles are only clipped against the sides when they reach outside this multiple of the viewport
+
+			template <typename Pipeline> void draw_cached_triangle_no_backface_culling(
 				const vertex_pos_cache &v1, const vertex_pos_cache &v2, const vertex_pos_cache &v3,
 				const vertex_normal_cache &n1, const vertex_normal_cache &n2, const vertex_normal_cache &n3,
 				const vec2 &uv1, const vec2 &uv2, const vec2 &uv3,
@@ -317,44 +597,53 @@ namespace rtt2 {
 					{ v2, n2, uv2, c2 },
 					{ v3, n3, uv3, c3 }
 				};
-				vertex_info *pv[3]{ &v[0], &v[1], &v[2] };
-				sort3(pv, [](vertex_info *vi1, vertex_info *vi2) {
-					return vi1->pos->cam_pos.z < vi2->pos->cam_pos.z;
-				});
-				vec2 ts[3];
-				if (pv[2]->pos->cam_pos.z > 0.0) {
+				unsigned char
+					code1 = v1.get_clip_code(), code2 = v2.get_clip_code(), code3 = v3.get_clip_code(),
+					gcode = v1.get_clip_code(guard_band) | v2.get_clip_code(guard_band) | v3.get_clip_code(guard_band);
+				if (code1 & code2 & code3) { // completely outside one of the planes
 					return;
-				} else if (pv[1]->pos->cam_pos.z > 0.0) {
-					_clip_against_xy(pv[2]->pos->cam_pos, pv[0]->pos->cam_pos, ts[0]);
-					_clip_against_xy(pv[2]->pos->cam_pos, pv[1]->pos->cam_pos, ts[1]);
-					ts[2] = pv[2]->pos->screen_pos;
+				}
+				vec2 ts[3];
+				if (gcode == 0) {
+					ts[0] = v1.screen_pos;
+					ts[1] = v2.screen_pos;
+					ts[2] = v3.screen_pos;
 					cur_buf.denormalize_scr_coord(ts[0]);
 					cur_buf.denormalize_scr_coord(ts[1]);
 					cur_buf.denormalize_scr_coord(ts[2]);
-					mode(*this, v, ts, tex, tag);
-				} else if (pv[0]->pos->cam_pos.z > 0.0) {
-					_clip_against_xy(pv[1]->pos->cam_pos, pv[0]->pos->cam_pos, ts[0]);
-					_clip_against_xy(pv[2]->pos->cam_pos, pv[0]->pos->cam_pos, ts[1]);
-					ts[2] = pv[2]->pos->screen_pos;
-					cur_buf.denormalize_scr_coord(ts[2]);
-					cur_buf.denormalize_scr_coord(ts[0]);
-					cur_buf.denormalize_scr_coord(ts[1]);
-					mode(*this, v, ts, tex, tag);
-					ts[1] = pv[1]->pos->screen_pos;
-					cur_buf.denormalize_scr_coord(ts[1]);
-					mode(*this, v, ts, tex, tag);
-				} else {
-					ts[0] = pv[0]->pos->screen_pos;
-					ts[1] = pv[1]->pos->screen_pos;
-					ts[2] = pv[2]->pos->screen_pos;
-					cur_buf.denormalize_scr_coord(ts[0]);
-					cur_buf.denormalize_scr_coord(ts[1]);
+					Pipeline::triangle(*this, v, ts, tex, tag);
+					return;
+				}
+				// only the planes that the triangle crosses are clipped against
+				const vec4 planes[6]{
+					vec4(1.0, 0.0, 0.0, guard_band), vec4(-1.0, 0.0, 0.0, guard_band),
+					vec4(0.0, 1.0, 0.0, guard_band), vec4(0.0, -1.0, 0.0, guard_band),
+					vec4(0.0, 0.0, -1.0, 0.0), vec4(0.0, 0.0, 1.0, 1.0)
+				};
+				vec4 poly[2][_max_clipped_vertices]{ { v1.cam_pos, v2.cam_pos, v3.cam_pos } };
+				size_t n = 3, cur = 0;
+				for (size_t i = 0; i < 6 && n >= 3; ++i) {
+					if (gcode & (1 << i)) {
+						n = _clip_polygon(poly[cur], n, planes[i], poly[1 - cur]);
+						cur = 1 - cur;
+					}
+				}
+				if (n < 3) {
+					return;
+				}
+				poly[cur][0].homogenize_2(ts[0]);
+				cur_buf.denormalize_scr_coord(ts[0]);
+				poly[cur][1].homogenize_2(ts[2]);
+				cur_buf.denormalize_scr_coord(ts[2]);
+				for (size_t i = 2; i < n; ++i) {
+					ts[1] = ts[2];
+					poly[cur][i].homogenize_2(ts[2]);
 					cur_buf.denormalize_scr_coord(ts[2]);
-					mode(*this, v, ts, tex, tag);
+					Pipeline::triangle(*this, v, ts, tex, tag);
 				}
 			}
 
-			void draw_cached_triangle(
+			template <typename Pipeline> void draw_cached_triangle(
 				const vertex_pos_cache &v1, const vertex_pos_cache &v2, const vertex_pos_cache &v3,
 				const vertex_normal_cache &n1, const vertex_normal_cache &n2, const vertex_normal_cache &n3,
 				const vec2 &uv1, const vec2 &uv2, const vec2 &uv3,
@@ -364,9 +653,9 @@ namespace rtt2 {
 				if (vec3::dot(v1.shaded_pos, vec3::cross(v2.shaded_pos, v3.shaded_pos)) > 0.0) {
 					return;
 				}
-				draw_cached_triangle_no_backface_culling(v1, v2, v3, n1, n2, n3, uv1, uv2, uv3, c1, c2, c3, tex, tag);
+				draw_cached_triangle_no_backface_culling<Pipeline>(v1, v2, v3, n1, n2, n3, uv1, uv2, uv3, c1, c2, c3, tex, tag);
 			}
-			void draw_triangle(
+			template <typename Pipeline> void draw_triangle(
 				const vec3 &p1, const vec3 &p2, const vec3 &p3,
 				const vec3 &n1, const vec3 &n2, const vec3 &n3,
 				const vec2 &uv1, const vec2 &uv2, const vec2 &uv3,
@@ -374,21 +663,49 @@ namespace rtt2 {
 				const texture *tex, void *tag
 			) {
 				vertex_cache vc[3];
-				shader_vtx(*this, *mat_modelview, p1, n1, vc[0].pos.shaded_pos, vc[0].normal.shaded_normal, tag);
-				shader_vtx(*this, *mat_modelview, p2, n2, vc[1].pos.shaded_pos, vc[1].normal.shaded_normal, tag);
-				shader_vtx(*this, *mat_modelview, p3, n3, vc[2].pos.shaded_pos, vc[2].normal.shaded_normal, tag);
+				Pipeline::vertex(*this, *mat_modelview, p1, n1, vc[0].pos.shaded_pos, vc[0].normal.shaded_normal, tag);
+				Pipeline::vertex(*this, *mat_modelview, p2, n2, vc[1].pos.shaded_pos, vc[1].normal.shaded_normal, tag);
+				Pipeline::vertex(*this, *mat_modelview, p3, n3, vc[2].pos.shaded_pos, vc[2].normal.shaded_normal, tag);
 				if (vec3::dot(vc[0].pos.shaded_pos, vec3::cross(vc[1].pos.shaded_pos, vc[2].pos.shaded_pos)) > 0.0) {
 					return;
 				}
 				vc[0].pos.complete(*mat_proj);
 				vc[1].pos.complete(*mat_proj);
 				vc[2].pos.complete(*mat_proj);
-				draw_cached_triangle_no_backface_culling(
+				draw_cached_triangle_no_backface_culling<Pipeline>(
 					vc[0].pos, vc[1].pos, vc[2].pos, vc[0].normal, vc[1].normal, vc[2].normal,
 					uv1, uv2, uv3, c1, c2, c3, tex, tag
 				);
 			}
 
+			void draw_cached_triangle_no_backface_culling(
+				const vertex_pos_cache &v1, const vertex_pos_cache &v2, const vertex_pos_cache &v3,
+				const vertex_normal_cache &n1, const vertex_normal_cache &n2, const vertex_normal_cache &n3,
+				const vec2 &uv1, const vec2 &uv2, const vec2 &uv3,
+				const color_vec &c1, const color_vec &c2, const color_vec &c3,
+				const texture *tex, void *tag
+			) {
+				draw_cached_triangle_no_backface_culling<dynamic_pipeline>(v1, v2, v3, n1, n2, n3, uv1, uv2, uv3, c1, c2, c3, tex, tag);
+			}
+			void draw_cached_triangle(
+				const vertex_pos_cache &v1, const vertex_pos_cache &v2, const vertex_pos_cache &v3,
+				const vertex_normal_cache &n1, const vertex_normal_cache &n2, const vertex_normal_cache &n3,
+				const vec2 &uv1, const vec2 &uv2, const vec2 &uv3,
+				const color_vec &c1, const color_vec &c2, const color_vec &c3,
+				const texture *tex, void *tag
+			) {
+				draw_cached_triangle<dynamic_pipeline>(v1, v2, v3, n1, n2, n3, uv1, uv2, uv3, c1, c2, c3, tex, tag);
+			}
+			void draw_triangle(
+				const vec3 &p1, const vec3 &p2, const vec3 &p3,
+				const vec3 &n1, const vec3 &n2, const vec3 &n3,
+				const vec2 &uv1, const vec2 &uv2, const vec2 &uv3,
+				const color_vec &c1, const color_vec &c2, const color_vec &c3,
+				const texture *tex, void *tag
+			) {
+				draw_triangle<dynamic_pipeline>(p1, p2, p3, n1, n2, n3, uv1, uv2, uv3, c1, c2, c3, tex, tag);
+			}
+
 			vertex_shader shader_vtx = nullptr;
 			test_shader shader_test = nullptr;
 			fragment_shader shader_frag = nullptr;
@@ -396,19 +713,20 @@ namespace rtt2 {
 			const mat4 *mat_proj = nullptr, *mat_modelview = nullptr;
 		protected:
 			struct _fragment_data {
-				device_color *color;
+				device_color *color; // nullptr when there's no color buffer
 				rtt2_float *z;
-				unsigned char *stencil;
+				unsigned char *stencil; // nullptr when there's no stencil buffer
+				size_t color_step, stencil_step; // 0 for the missing buffers, so that their null pointers stay put
 
 				void incr() {
-					++color;
+					color += color_step;
 					++z;
-					++stencil;
+					stencil += stencil_step;
 				}
 				void decr() {
-					--color;
+					color -= color_step;
 					--z;
-					--stencil;
+					stencil -= stencil_step;
 				}
 			};
 			device_color *_get_color_buf_at(size_t x, size_t y) const {
@@ -416,9 +734,11 @@ namespace rtt2 {
 			}
 			void _get_fragment_data_at(size_t x, size_t y, _fragment_data &data) const {
 				size_t id = cur_buf.w * y + x;
-				data.color = cur_buf.color_arr + id;
+				data.color = (cur_buf.color_arr ? cur_buf.color_arr + id : nullptr);
 				data.z = cur_buf.depth_arr + id;
-				data.stencil = cur_buf.stencil_arr + id;
+				data.stencil = (cur_buf.stencil_arr ? cur_buf.stencil_arr + id : nullptr);
+				data.color_step = (cur_buf.color_arr ? 1 : 0);
+				data.stencil_step = (cur_buf.stencil_arr ? 1 : 0);
 			}
 		};
 	}
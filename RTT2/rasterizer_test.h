@@ -9,6 +9,9 @@
 #include "buffer.h"
 #include "model.h"
 #include "renderer.h"
+#include "shadow_atlas.h"
+#include "volumetric.h"
+#include "temporal.h"
 #include "enhancement.h"
 #include "raytracer.h"
 
@@ -17,7 +20,8 @@ using namespace rtt2;
 #define WND_WIDTH 1440
 #define WND_HEIGHT 900
 
-#define SHADOW_BUFFER_SIZE 1000
+#define SHADOW_BUFFER_SIZE 1024 // the largest shadow map
+#define SHADOW_ATLAS_SIZE 2048
 #define MODEL_FILE "rsrc/buddha.obj"
 #define TEXTURE_FILE "rsrc/po_img.ppm"
 #define BUF_WIDTH 720
@@ -28,6 +32,7 @@ using namespace rtt2;
 #define INIT_CAM_POS -5.0, -4.0, 3.0
 #define MOVE_MULT 0.5
 #define ZFAR 100.0
+#define BENCHMARK_FRAMES 50
 
 LRESULT CALLBACK wndproc(HWND, UINT, WPARAM, LPARAM);
 
@@ -69,6 +74,11 @@ mat4 cammod, camproj;
 
 texture tex, dep;
 rasterizing::scene_cache defsc;
+rasterizing::light_clusters defcl;
+rasterizing::light_batches deflb;
+rasterizing::volumetric_lighting volumetrics;
+rasterizing::temporal_accumulation fx_history;
+size_t fx_frame = 0;
 rasterizing::scene_description scene;
 brdf_phong mtrl(1.0, 1.0, 50.0);
 model_data mdl1;
@@ -82,16 +92,19 @@ rasterizing::point_light_data l3;
 void initialize_scene() {
 	std::cout << "loading textures...";
 	{
-		std::ifstream in(TEXTURE_FILE);
+		std::ifstream in(TEXTURE_FILE, std::ios::binary);
 		tex.load_ppm(in);
 	}
-	tex.make_float_cache_nocheck();
+	tex.set_layout(texture_layout::tiled);
+	tex.make_mipmaps();
+	tex.mode_sample = sample_mode::anisotropic;
 
 	{
-		std::ifstream in("rsrc/po_depth.ppm");
+		std::ifstream in("rsrc/po_depth.ppm", std::ios::binary);
 		dep.load_ppm(in);
 	}
-	dep.make_float_cache_nocheck();
+	dep.set_layout(texture_layout::tiled);
+	dep.make_mipmaps();
 	std::cout << " done\n";
 
 	std::cout << "loading models...";
@@ -102,6 +115,7 @@ void initialize_scene() {
 	if (mdl1.normals.size() == 1) {
 		mdl1.generate_normals_weighted_average();
 	}
+	mdl1.make_index_cache();
 	mdl2.points.push_back(vec3(-20.0, -20.0, 0.0));
 	mdl2.points.push_back(vec3(20.0, -20.0, 0.0));
 	mdl2.points.push_back(vec3(-20.0, 20.0, 0.0));
@@ -127,6 +141,7 @@ void initialize_scene() {
 	fi.vertex_ids[0] = 2;
 	fi.vertex_ids[2] = 3;
 	mdl2.faces.push_back(fi);
+	mdl2.make_index_cache();
 	mm2.set_identity();
 	std::cout << " done\n";
 
@@ -151,6 +166,7 @@ void initialize_scene() {
 	scene.models.push_back(rasterizing::model(&mdl1, &mtrl, &mm1, &tex, nullptr, color_vec(1.0, 1.0, 1.0, 1.0)));
 	test_po.depth = 0.2;
 	test_po.depth_tex = &dep;
+	test_po.make_cache();
 	scene.models.push_back(rasterizing::model(&mdl2, &mtrl, &mm2, &tex, &test_po, color_vec(1.0, 1.0, 1.0, 1.0)));
 
 	rend.mat_modelview = &cammod;
@@ -162,69 +178,41 @@ void initialize_scene() {
 	rend.refresh_cache();
 }
 
-rasterizing::mem_depth_buffer s2ds(SHADOW_BUFFER_SIZE, SHADOW_BUFFER_SIZE), s3ds[6]{
-	{ SHADOW_BUFFER_SIZE, SHADOW_BUFFER_SIZE },
-	{ SHADOW_BUFFER_SIZE, SHADOW_BUFFER_SIZE },
-	{ SHADOW_BUFFER_SIZE, SHADOW_BUFFER_SIZE },
-	{ SHADOW_BUFFER_SIZE, SHADOW_BUFFER_SIZE },
-	{ SHADOW_BUFFER_SIZE, SHADOW_BUFFER_SIZE },
-	{ SHADOW_BUFFER_SIZE, SHADOW_BUFFER_SIZE }
-};
+rasterizing::shadow_atlas shadow_maps(SHADOW_ATLAS_SIZE, 64);
 
 void render_full_fx();
 void render_shadows();
+void run_benchmark();
 
-void render_volumetric_shadow(const rasterizing::scene_description &sd, rasterizing::scene_cache &sc, const mat4 &proj, const rasterizing::mem_depth_buffer &db, const camera &cs, const rasterizing::buffer_set &bs, size_t split = 100) {
-	rtt2_float zinc = (cs.zfar - cs.znear) / split, xsc = std::tan(cs.hori_fov * 0.5), ysc = xsc * cs.aspect_ratio;
-	for (size_t y = 0; y < bs.h; ++y) {
-		for (size_t x = 0; x < bs.w; ++x) {
-			rtt2_float cur = -cs.znear, d = *db.get_at(x, y);
-			color_vec_rgb res(0.0, 0.0, 0.0);
-			for (size_t i = 0; i < split; ++i, cur -= zinc) {
-				rtt2_float crv = cur - zinc * std::rand() / static_cast<rtt2_float>(RAND_MAX);
-				rtt2_float rx = (2 * x + 1) / static_cast<rtt2_float>(bs.w) - 1.0, ry = (2 * y + 1) / static_cast<rtt2_float>(bs.h) - 1.0;
-				rx *= -crv * xsc;
-				ry *= -crv * ysc;
-				vec3 rp(rx, ry, crv);
-				vec4 rs = proj * vec4(rp);
-				rtt2_float cz = rs.z / rs.w;
-				if (cz < d) {
-					break;
-				}
-				for (size_t cl = 0; cl < sd.lights.size(); ++cl) {
-					vec3 ti;
-					color_vec_rgb c;
-					if (sd.lights[cl].data->get_illum(sc.of_lights[cl], rp, ti, c)) {
-						if (!sd.lights[cl].in_shadow(rp)) {
-							res += c * 0.1; // TODO refine the formula
-						}
-					}
-				}
-			}
-			res *= zinc;
-			clamp_vec(res, 0.0, 1.0);
-			bs.get_at(x, y, bs.color_arr)->from_vec4(vec4(res, 1.0));
-		}
-	}
-}
 void render_shadows() {
 	std::cout << "generating shadow map...";
 	rasterizing::shadow_settings set;
+	shadow_maps.reset();
 
 	set.of_spotlight.znear = 2.0;
 	set.of_spotlight.zfar = 60.0;
 	set.of_spotlight.tolerance = 0.001;
-	rasterizing::buffer_set bs(SHADOW_BUFFER_SIZE, SHADOW_BUFFER_SIZE, nullptr, s2ds.get_arr(), nullptr);
-	scene.lights[0].build_shadow_cache(scene, &bs, set);
+	set.of_spotlight.filter.mode = rasterizing::shadow_filter_mode::pcf;
+	set.of_spotlight.filter.radius = 2;
+	rasterizing::buffer_set bs;
+	if (shadow_maps.allocate_for(scene.lights[0], cammod, camproj, set, SHADOW_BUFFER_SIZE, &bs)) {
+		scene.lights[0].build_shadow_cache(scene, &bs, set);
+	} else { // its old regions were freed by reset()
+		scene.lights[0].has_shadow = false;
+	}
 
 	set.of_pointlight.tolerance = 0.001;
 	set.of_pointlight.znear = 0.1;
 	set.of_pointlight.zfar = 60.0;
+	set.of_pointlight.filter.mode = rasterizing::shadow_filter_mode::exponential;
+	set.of_pointlight.filter.radius = 2;
+	set.of_pointlight.filter.exponent = 60.0;
 	rasterizing::buffer_set bss[6];
-	for (size_t i = 0; i < 6; ++i) {
-		bss[i].set(SHADOW_BUFFER_SIZE, SHADOW_BUFFER_SIZE, nullptr, s3ds[i].get_arr(), nullptr);
+	if (shadow_maps.allocate_for(scene.lights[1], cammod, camproj, set, SHADOW_BUFFER_SIZE, bss)) {
+		scene.lights[1].build_shadow_cache(scene, bss, set);
+	} else { // its old regions were freed by reset()
+		scene.lights[1].has_shadow = false;
 	}
-	scene.lights[1].build_shadow_cache(scene, bss, set);
 
 	for (auto i = scene.lights.begin(); i != scene.lights.end(); ++i) {
 		if (i->has_shadow) {
@@ -238,43 +226,70 @@ void render_full_fx() {
 	rasterizing::basic_renderer prend;
 	rasterizing::rasterizer prast;
 	rasterizing::mem_depth_buffer mdb(WND_WIDTH, WND_HEIGHT);
-	mem_color_buffer mcb(WND_WIDTH, WND_HEIGHT);
 	prast.cur_buf.set(WND_WIDTH, WND_HEIGHT, full_rendering_buf.get_arr(), mdb.get_arr(), nullptr);
 	prast.clear_color_buf(device_color(255, 0, 0, 0));
 	prast.clear_depth_buf(-1.0);
-	mcb.clear(device_color(0, 0, 0, 0));
 	prend.scene = &scene;
 	prend.cache = &defsc;
+	prend.clusters = &defcl;
+	prend.batches = &deflb;
 	prend.linked_rasterizer = &prast;
 	prend.mat_modelview = &cammod;
 	prend.mat_projection = &camproj;
 	prend.setup_rendering_env();
 	long long t1, t2;
 	t1 = get_time();
-	prend.render_cached();
-	render_volumetric_shadow(scene, defsc, camproj, mdb, cam, rasterizing::buffer_set(WND_WIDTH, WND_HEIGHT, mcb.get_arr(), nullptr, nullptr), 20);
-	device_color *a = mcb.get_arr(), *b = full_rendering_buf.get_arr();
-	for (size_t i = WND_WIDTH * WND_HEIGHT; i > 0; --i, ++a, ++b) {
-		vec4 av, bv;
-		a->to_vec4(av);
-		b->to_vec4(bv);
-		av += bv;
-		clamp_vec(av, 0.0, 1.0);
-		b->from_vec4(av);
-	}
+	prend.render_cached<rasterizing::basic_renderer::default_pipeline>();
+	// the volumetric samples move by the golden ratio every frame, & the frames are accumulated
+	volumetrics.build(scene, defsc.of_lights, camproj, std::fmod(fx_frame * 0.618034, 1.0));
+	volumetrics.apply(prast.cur_buf);
+	fx_history.accumulate(prast.cur_buf, cammod, camproj);
+	++fx_frame;
 	t2 = get_time();
 	enlarged_copy(full_rendering_buf, finalbuf);
 	finalbuf.display(wnd.get_dc());
 	std::cout << "  done with " << (static_cast<rtt2_float>(get_timer_freq()) / (t2 - t1)) << " fps\n";
 }
+// times the per-frame work of the interactive view; build the float & double configurations to compare them
+void run_benchmark() {
+#ifdef RTT2_USE_FLOAT
+	std::cout << "benchmarking with single precision...";
+#else
+	std::cout << "benchmarking with double precision...";
+#endif
+	long long trefresh = 0, trender = 0, t1, t2, t3;
+	for (size_t i = 0; i < BENCHMARK_FRAMES; ++i) {
+		for (auto j = defsc.of_models.begin(); j != defsc.of_models.end(); ++j) {
+			j->dirty = true;
+		}
+		rast.clear_color_buf(device_color(255, 0, 0, 0));
+		rast.clear_depth_buf(-1.0);
+		t1 = get_time();
+		rend.refresh_cache();
+		t2 = get_time();
+		rend.setup_compact_rendering_env();
+		rend.render_cached<rasterizing::basic_renderer::compact_pipeline>();
+		rast.resolve_msaa();
+		t3 = get_time();
+		trefresh += t2 - t1;
+		trender += t3 - t2;
+	}
+	rtt2_float mult = 1000.0 / (static_cast<rtt2_float>(get_timer_freq()) * BENCHMARK_FRAMES);
+	std::cout << "  done\n";
+	std::cout << "  refresh " << trefresh * mult << " ms, render " << trender * mult << " ms per frame\n";
+	std::cout << "  " << sizeof(vec3) << " bytes per vec3, " << sizeof(rasterizing::vertex_pos_cache) << " bytes per cached vertex\n";
+}
 
 int main() {
 	mem_color_buffer screen_buf(BUF_WIDTH, BUF_HEIGHT);
 	rasterizing::mem_depth_buffer mdb(BUF_WIDTH, BUF_HEIGHT);
+	mem_color_buffer msaa_cb(BUF_WIDTH * rasterizing::buffer_set::msaa_samples, BUF_HEIGHT);
+	rasterizing::mem_depth_buffer msaa_db(BUF_WIDTH * rasterizing::buffer_set::msaa_samples, BUF_HEIGHT);
 	stopwatch stw;
-	key_monitor incd, decd;
+	key_monitor incd, decd, benchk;
 
 	rast.cur_buf.set(BUF_WIDTH, BUF_HEIGHT, screen_buf.get_arr(), mdb.get_arr(), nullptr);
+	rast.cur_buf.set_msaa(msaa_cb.get_arr(), msaa_db.get_arr());
 
 	cam.hori_fov = 60.0 * RTT2_PI / 180.0;
 	cam.aspect_ratio = BUF_HEIGHT / static_cast<rtt2_float>(BUF_WIDTH);
@@ -292,11 +307,14 @@ int main() {
 	rend.mat_modelview = &cammod;
 	rend.mat_projection = &camproj;
 	rend.cache = &defsc;
+	rend.clusters = &defcl;
+	rend.batches = &deflb;
 
 	initialize_scene();
 
 	incd.set(VK_F1, nullptr, render_shadows);
 	decd.set(VK_F2, nullptr, render_shadows);
+	benchk.set(VK_F3, run_benchmark, nullptr);
 
 	wnd.set_client_size(WND_WIDTH, WND_HEIGHT);
 	wnd.set_center();
@@ -320,6 +338,7 @@ int main() {
 
 		incd.update();
 		decd.update();
+		benchk.update();
 
 		if (incd.down() != decd.down()) {
 			if (incd.down()) {
@@ -350,6 +369,7 @@ int main() {
 			for (auto i = scene.lights.begin(); i != scene.lights.end(); ++i) {
 				if (i->has_shadow) {
 					i->set_camera_mat(cammod);
+					i->refresh_shadow_cache();
 				}
 			}
 
@@ -373,7 +393,8 @@ int main() {
 			rend.refresh_cache();
 
 			rend.setup_compact_rendering_env();
-			rend.render_cached();
+			rend.render_cached<rasterizing::basic_renderer::compact_pipeline>();
+			rast.resolve_msaa();
 
 			enlarged_copy(screen_buf, finalbuf);
 			finalbuf.display(wnd.get_dc());
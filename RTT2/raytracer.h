@@ -36,36 +36,34 @@ namespace rtt2 {
 
 		struct model_cache {
 			model_cache() = default;
-			model_cache(const rasterizing::model_cache &mc) {
-				set(mc);
+			model_cache(const model_data &md, const rasterizing::model_cache &mc) {
+				set(md, mc);
 			}
 
-			void set(const rasterizing::model_cache &mc) {
-				pos_cache.resize(mc.pos_cache.size());
-				for (size_t i = 0; i < mc.pos_cache.size(); ++i) {
-					pos_cache[i] = mc.pos_cache[i].shaded_pos;
+			// transforms every point & normal with the transform of the rasterizer's cache, since the rasterizer only
+			// shades the ones of faces that survive culling, while paths also hit culled faces
+			void set(const model_data &md, const rasterizing::model_cache &mc) {
+				pos_cache.resize(md.points.size());
+				normal_cache.resize(md.normals.size());
+				for (size_t i = 0; i < md.points.size(); ++i) {
+					transform_default(mc.mat_cache, md.points[i], pos_cache[i]);
 				}
-				normal_cache.resize(mc.normal_cache.size());
-				for (size_t i = 0; i < mc.normal_cache.size(); ++i) {
-					normal_cache[i] = mc.normal_cache[i].shaded_normal;
+				for (size_t i = 0; i < md.normals.size(); ++i) {
+					transform_default(mc.mat_cache, md.normals[i], normal_cache[i], 0.0);
 				}
 			}
 
 			std::vector<vec3> pos_cache;
 			std::vector<vec3> normal_cache;
 		};
+		struct scene_description;
 		struct scene_cache {
 			scene_cache() = default;
-			scene_cache(const rasterizing::scene_cache &sc) {
-				set(sc);
+			scene_cache(const scene_description &sd, const rasterizing::scene_cache &sc) {
+				set(sd, sc);
 			}
 
-			void set(const rasterizing::scene_cache &sc) {
-				of_models.resize(sc.of_models.size());
-				for (size_t i = 0; i < of_models.size(); ++i) {
-					of_models[i].set(sc.of_models[i]);
-				}
-			}
+			void set(const scene_description&, const rasterizing::scene_cache&);
 
 			std::vector<model_cache> of_models;
 		};
@@ -75,6 +73,13 @@ namespace rtt2 {
 			std::vector<light*> lights;
 		};
 
+		inline void scene_cache::set(const scene_description &sd, const rasterizing::scene_cache &sc) {
+			of_models.resize(sc.of_models.size());
+			for (size_t i = 0; i < of_models.size(); ++i) {
+				of_models[i].set(*sd.models[i].data, sc.of_models[i]);
+			}
+		}
+
 		typedef mem_buffer<color_vec> mem_color_accum_buffer;
 		typedef mem_buffer<size_t> mem_hitcount_buffer;
 		struct buffer_set {
@@ -232,6 +237,16 @@ namespace rtt2 {
 						}
 					}
 				}
+				_light_cast_impl(pos, dir, output, ignore, min_dist);
+				if (output.type != ray_hit_type::hit_nothing) {
+					output.hit_point = pos + dir * min_dist;
+				}
+			}
+			// replaces the hit of output with the nearest light in front of it, whose distance is min_dist
+			void _light_cast_impl(
+				const vec3 &pos, const vec3 &dir,
+				ray_cast_output &output, const ray_cast_output &ignore, rtt2_float &min_dist
+			) const {
 				light::hit_test_result lres;
 				for (auto i = scene->lights.begin(); i != scene->lights.end(); ++i) {
 					if (ignore.type != ray_hit_type::hit_light || ignore.hit.light != *i) {
@@ -244,26 +259,21 @@ namespace rtt2 {
 						}
 					}
 				}
-				if (output.type != ray_hit_type::hit_nothing) {
-					output.hit_point = pos + dir * min_dist;
-				}
 			}
-		public:
-			std::vector<vec3> trace_path_debug(const vec2 &pos, randomizer rand, size_t iters = 5) {
-				std::vector<vec3> ret;
-				ray_cast_output out, ign;
-				vec3 vo, vd;
+			// continues a path from the result of its camera ray
+			void _trace_path_impl(const vec2 &pos, vec3 vd, ray_cast_output &out, randomizer rand, size_t iters) {
+				ray_cast_output ign;
+				vec3 vo;
 				color_vec_rgb res(1.0, 1.0, 1.0);
-				cam->screen_to_ray(pos, vo, vd);
-				vd.set_length(1.0);
 				size_t
 					x = clamp<size_t>(static_cast<size_t>(std::floor(pos.x * buffer.w)), 0, buffer.w - 1),
 					y = clamp<size_t>(static_cast<size_t>(std::floor(pos.y * buffer.h)), 0, buffer.h - 1);
 				size_t &statv = *buffer.get_at(x, y, buffer.stat_arr);
 				color_vec &colorv = *buffer.get_at(x, y, buffer.color_arr);
-				ret.push_back(cam->pos);
 				for (size_t i = 0; i < iters; ++i) {
-					_ray_cast_impl(vo, vd, out, ign);
+					if (i > 0) {
+						_ray_cast_impl(vo, vd, out, ign);
+					}
 					if (out.type == ray_hit_type::hit_model) {
 						_hitpoint_info hi;
 						_get_hitpoint_info(out, hi);
@@ -273,13 +283,10 @@ namespace rtt2 {
 						color_vec_rgb illum;
 						scene->models[out.hit.model.id].mtrl.dist_func->get_illum(-vd, -indir, hi.normal, res, res);
 						res = vec_mult(res, hi.color);
-						ret.push_back(vo);
 					} else {
 						if (out.type == ray_hit_type::hit_nothing) {
-							ret.push_back(vo + vd);
 							res = color_vec_rgb();
 						} else if (out.type == ray_hit_type::hit_light) {
-							ret.push_back(out.hit_point);
 							res = vec_mult(res, out.hit.light->illum);
 						}
 						break;
@@ -288,9 +295,10 @@ namespace rtt2 {
 				}
 				++statv;
 				colorv += color_vec(res, 0.0);
-				return ret;
 			}
-			void trace_path(const vec2 &pos, randomizer rand, size_t iters = 5) {
+		public:
+			std::vector<vec3> trace_path_debug(const vec2 &pos, randomizer rand, size_t iters = 5) {
+				std::vector<vec3> ret;
 				ray_cast_output out, ign;
 				vec3 vo, vd;
 				color_vec_rgb res(1.0, 1.0, 1.0);
@@ -301,6 +309,7 @@ namespace rtt2 {
 					y = clamp<size_t>(static_cast<size_t>(std::floor(pos.y * buffer.h)), 0, buffer.h - 1);
 				size_t &statv = *buffer.get_at(x, y, buffer.stat_arr);
 				color_vec &colorv = *buffer.get_at(x, y, buffer.color_arr);
+				ret.push_back(cam->pos);
 				for (size_t i = 0; i < iters; ++i) {
 					_ray_cast_impl(vo, vd, out, ign);
 					if (out.type == ray_hit_type::hit_model) {
@@ -312,10 +321,13 @@ namespace rtt2 {
 						color_vec_rgb illum;
 						scene->models[out.hit.model.id].mtrl.dist_func->get_illum(-vd, -indir, hi.normal, res, res);
 						res = vec_mult(res, hi.color);
+						ret.push_back(vo);
 					} else {
 						if (out.type == ray_hit_type::hit_nothing) {
+							ret.push_back(vo + vd);
 							res = color_vec_rgb();
 						} else if (out.type == ray_hit_type::hit_light) {
+							ret.push_back(out.hit_point);
 							res = vec_mult(res, out.hit.light->illum);
 						}
 						break;
@@ -324,6 +336,50 @@ namespace rtt2 {
 				}
 				++statv;
 				colorv += color_vec(res, 0.0);
+				return ret;
+			}
+			void trace_path(const vec2 &pos, randomizer rand, size_t iters = 5) {
+				ray_cast_output out;
+				vec3 vo, vd;
+				cam->screen_to_ray(pos, vo, vd);
+				vd.set_length(1.0);
+				_ray_cast_impl(vo, vd, out, ray_cast_output());
+				_trace_path_impl(pos, vd, out, rand, iters);
+			}
+			// the same as trace_path(), but the first hit is taken from a visibility buffer that the rasterizer rendered
+			// with the same camera, e.g. with rasterizing::basic_renderer::visibility_pipeline, & the camera ray is only
+			// tested against lights; primary hits are at the pixel centers of the visibility buffer
+			// the hit is rebuilt from the cache, so build_cache() must be called after the models move & before the
+			// visibility buffer is used
+			void trace_path(const vec2 &pos, const rasterizing::visibility_sample &vs, randomizer rand, size_t iters = 5) {
+				ray_cast_output out;
+				vec3 vo, vd;
+				rtt2_float dist = 0.0;
+				if (vs.model == rasterizing::visibility_sample::no_model) {
+					cam->screen_to_ray(pos, vo, vd);
+					vd.set_length(1.0);
+				} else {
+					const model_cache &mcc = cache->of_models[vs.model];
+					const model_data::face_info &fi = scene->models[vs.model].data->faces[vs.face];
+					out.type = ray_hit_type::hit_model;
+					out.hit.model.id = vs.model;
+					out.hit.model.face = vs.face;
+					out.hit.model.u = vs.u;
+					out.hit.model.v = vs.v;
+					out.hit_point =
+						(1.0 - vs.u - vs.v) * mcc.pos_cache[fi.vertex_ids[0]] +
+						vs.u * mcc.pos_cache[fi.vertex_ids[1]] +
+						vs.v * mcc.pos_cache[fi.vertex_ids[2]];
+					vo = cam->pos;
+					vd = out.hit_point - vo;
+					dist = vd.length();
+					vd *= 1.0 / dist;
+				}
+				_light_cast_impl(vo, vd, out, ray_cast_output(), dist);
+				if (out.type == ray_hit_type::hit_light) {
+					out.hit_point = vo + vd * dist;
+				}
+				_trace_path_impl(pos, vd, out, rand, iters);
 			}
 
 			void trace_scene_gist(mem_color_buffer &buf) const {
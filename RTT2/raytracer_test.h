@@ -73,6 +73,7 @@ raytracing::camera_info rtcam;
 
 texture tex, dep;
 rasterizing::scene_cache defsc;
+rasterizing::mem_visibility_buffer visbuf(BUF_WIDTH, BUF_HEIGHT);
 rasterizing::scene_description scene;
 raytracing::scene_cache tracercache;
 raytracing::scene_description raysd;
@@ -85,10 +86,10 @@ rasterizing::point_light_data l3;
 void initialize_scene() {
 	std::cout << "loading textures...";
 	{
-		std::ifstream in(TEXTURE_FILE);
+		std::ifstream in(TEXTURE_FILE, std::ios::binary);
 		tex.load_ppm(in);
 	}
-	tex.make_float_cache_nocheck();
+	tex.make_mipmaps();
 
 	std::cout << " done\n";
 
@@ -100,6 +101,7 @@ void initialize_scene() {
 	if (mdl1.normals.size() == 1) {
 		mdl1.generate_normals_flat();
 	}
+	mdl1.make_index_cache();
 	std::cout << " done\n";
 
 	get_trans_rotation_3(vec3(0.0, 0.0, 0.0), vec3(1.0, 0.0, 0.0), RTT2_PI * 0.5, mm1);
@@ -142,6 +144,14 @@ rtt2_float f_rand() {
 	return dist(eng);
 }
 
+// traces a path whose first hit is read from the visibility buffer
+void trace_path_hybrid(const vec2 &pos) {
+	size_t
+		x = clamp<size_t>(static_cast<size_t>(std::max<rtt2_float>(pos.x * BUF_WIDTH, 0.0)), 0, BUF_WIDTH - 1),
+		y = clamp<size_t>(static_cast<size_t>(std::max<rtt2_float>(pos.y * BUF_HEIGHT, 0.0)), 0, BUF_HEIGHT - 1);
+	tracer.trace_path(pos, *visbuf.get_at(x, y), f_rand);
+}
+
 void render_polyline(rasterizing::basic_renderer &r, const std::vector<vec3> &pts, const device_color &c) {
 	rasterizing::vertex_pos_cache last, cur;
 	vec3 dummy;
@@ -226,6 +236,14 @@ int main() {
 				rtc = 0;
 				rtcam.set(cam);
 				tracer.buffer.clear();
+				tracer.build_cache(); // the paths start from the hits of the visibility buffer, which is rendered below
+				get_trans_camview_3(cam, cammod); // the camera may have moved since cammod was last made
+				get_trans_frustrum_3(cam, camproj);
+				rend.visibility = visbuf.get_arr();
+				rend.clear_visibility();
+				rend.refresh_cache();
+				rend.setup_visibility_rendering_env();
+				rend.render_cached<rasterizing::basic_renderer::visibility_pipeline>();
 				std::cout << "ray tracing begun\n";
 			}
 		}
@@ -275,7 +293,7 @@ int main() {
 
 			rend.setup_compact_rendering_env();
 			//rend.setup_rendering_env();
-			rend.render_cached();
+			rend.render_cached<rasterizing::basic_renderer::compact_pipeline>();
 
 			enlarged_copy(screen_buf, finalbuf);
 
@@ -293,11 +311,11 @@ int main() {
 					dbg_pts = tracer.trace_path_debug(vec2(x, y), f_rand);
 				}
 				for (size_t i = 0; i < BATCH_SIZE; ++i) {
-					tracer.trace_path(vec2(x + (f_rand() - 0.5) * 0.1, y + (f_rand() - 0.5) * 0.1), f_rand);
+					trace_path_hybrid(vec2(x + (f_rand() - 0.5) * 0.1, y + (f_rand() - 0.5) * 0.1));
 				}
 			} else {
 				for (size_t i = 0; i < BATCH_SIZE; ++i) {
-					tracer.trace_path(vec2(f_rand(), f_rand()), f_rand);
+					trace_path_hybrid(vec2(f_rand(), f_rand()));
 				}
 			}
 			rtc += BATCH_SIZE;
@@ -1,9 +1,11 @@
 #pragma once
 
 #include <atomic>
+#include <algorithm>
 
 #include "rasterizer.h"
 #include "enhancement.h"
+#include "sampler.h"
 
 namespace rtt2 {
 	namespace rasterizing {
@@ -13,15 +15,281 @@ namespace rtt2 {
 		};
 
 		struct model_cache {
-			std::vector<vertex_pos_cache> pos_cache;
-			std::vector<vertex_normal_cache> normal_cache;
+			std::vector<vertex_pos_cache> pos_cache; // indexed by model_data::index_cache point ids
+			vertex_pos_batch_cache pos_batch; // in the same order as pos_cache, used for culling
+			std::vector<vertex_normal_cache> normal_cache; // indexed by model_data::index_cache normal ids
+			std::vector<unsigned char> pos_valid, normal_valid, cluster_visible, face_visible;
+			std::vector<size_t> visible_faces;
 			dyn_mem_arr enhancement_face_cache;
-			mat4 mat_cache;
+			mat4 mat_cache, mat_proj_cache; // the transforms that the cache was last built with
+			bool dirty = true; // set when the geometry of the model changes, so that the next refresh isn't skipped
 		};
 		struct scene_cache {
 			std::vector<model_cache> of_models;
 			std::vector<light_cache> of_lights;
 		};
+		// an element of a visibility buffer: the face that's visible at a pixel, & the barycentric coordinates of the
+		// pixel center on it, so that the point is v0 * (1 - u - v) + v1 * u + v2 * v
+		struct visibility_sample {
+			constexpr static size_t no_model = static_cast<size_t>(-1);
+
+			size_t model, face;
+			rtt2_float u, v;
+		};
+		typedef mem_buffer<visibility_sample> mem_visibility_buffer;
+
+		// lights binned into clusters of a perspective view frustum, which are screen tiles split into slices whose
+		// depths grow exponentially; lights without bounds are put into global_lights and affect every cluster
+		struct light_clusters {
+			size_t tiles_x = 16, tiles_y = 8, slices = 16;
+			std::vector<size_t> offsets; // the lights of cluster i are light_ids[offsets[i]] to light_ids[offsets[i + 1] - 1]
+			std::vector<size_t> light_ids, global_lights;
+
+			// the clusters are in view space, and so are the light caches
+			void build(const scene_description &scene, const std::vector<light_cache> &lc, const mat4 &proj) {
+				_proj = proj;
+				_znear = -_get_view_z(0.0);
+				_zfar = -_get_view_z(-1.0);
+				_slice_mult = slices / std::log(_zfar / _znear);
+				size_t nclusters = tiles_x * tiles_y * slices;
+				global_lights.clear();
+				_pairs.clear();
+				for (size_t i = 0; i < scene.lights.size(); ++i) {
+					vec3 c;
+					rtt2_float r;
+					if (!scene.lights[i].data->get_bounds(lc[i], c, r)) {
+						global_lights.push_back(i);
+						continue;
+					}
+					if (c.z - r > -_znear || -(c.z + r) > _zfar) {
+						continue;
+					}
+					size_t tx0 = 0, tx1 = tiles_x - 1, ty0 = 0, ty1 = tiles_y - 1;
+					if (c.z + r < -_znear) { // otherwise the sphere can cover the whole screen
+						rtt2_float nx0 = INFINITY, nx1 = -INFINITY, ny0 = INFINITY, ny1 = -INFINITY;
+						for (size_t k = 0; k < 8; ++k) {
+							vec4 cp = proj * vec4(c.x + (k & 1 ? r : -r), c.y + (k & 2 ? r : -r), c.z + (k & 4 ? r : -r), 1.0);
+							nx0 = std::min(nx0, cp.x / cp.w);
+							nx1 = std::max(nx1, cp.x / cp.w);
+							ny0 = std::min(ny0, cp.y / cp.w);
+							ny1 = std::max(ny1, cp.y / cp.w);
+						}
+						if (nx0 > 1.0 || nx1 < -1.0 || ny0 > 1.0 || ny1 < -1.0) {
+							continue;
+						}
+						tx0 = _get_tile(nx0, tiles_x);
+						tx1 = _get_tile(nx1, tiles_x);
+						ty0 = _get_tile(ny0, tiles_y);
+						ty1 = _get_tile(ny1, tiles_y);
+					}
+					size_t s0 = _get_slice(-(c.z + r)), s1 = _get_slice(-(c.z - r));
+					for (size_t sl = s0; sl <= s1; ++sl) {
+						for (size_t ty = ty0; ty <= ty1; ++ty) {
+							for (size_t tx = tx0; tx <= tx1; ++tx) {
+								if (_sphere_touches_cluster(c, r, tx, ty, sl)) {
+									_pairs.push_back(std::make_pair((sl * tiles_y + ty) * tiles_x + tx, i));
+								}
+							}
+						}
+					}
+				}
+				offsets.assign(nclusters + 1, 0);
+				for (auto i = _pairs.begin(); i != _pairs.end(); ++i) {
+					++offsets[i->first + 1];
+				}
+				for (size_t i = 0; i < nclusters; ++i) {
+					offsets[i + 1] += offsets[i];
+				}
+				light_ids.resize(_pairs.size());
+				_fill = std::vector<size_t>(offsets.begin(), offsets.end() - 1);
+				for (auto i = _pairs.begin(); i != _pairs.end(); ++i) {
+					light_ids[_fill[i->first]++] = i->second;
+				}
+			}
+			// the cluster of a fragment, from its view space & clip space positions
+			size_t get_cluster(const vec3 &pos3, const vec4 &pos4) const {
+				return (_get_slice(-pos3.z) * tiles_y + _get_tile(pos4.y / pos4.w, tiles_y)) * tiles_x + _get_tile(pos4.x / pos4.w, tiles_x);
+			}
+		protected:
+			mat4 _proj;
+			rtt2_float _znear, _zfar, _slice_mult;
+			std::vector<std::pair<size_t, size_t>> _pairs; // cluster & light, in the order of the lights
+			std::vector<size_t> _fill;
+
+			rtt2_float _get_view_z(rtt2_float ndcz) const {
+				return (_proj[3][2] - ndcz * _proj[3][3]) / (ndcz * _proj[2][3] - _proj[2][2]);
+			}
+			size_t _get_slice(rtt2_float depth) const {
+				rtt2_float v = std::floor(std::log(std::max(depth, _znear) / _znear) * _slice_mult);
+				return static_cast<size_t>(std::min<rtt2_float>(v, slices - 1.0));
+			}
+			rtt2_float _get_slice_depth(size_t sl) const {
+				return _znear * std::pow(_zfar / _znear, sl / static_cast<rtt2_float>(slices));
+			}
+			inline static size_t _get_tile(rtt2_float ndc, size_t n) {
+				return static_cast<size_t>(clamp<rtt2_float>(std::floor((ndc + 1.0) * 0.5 * n), 0.0, n - 1.0));
+			}
+			// the box around the cluster in view space, against the sphere
+			bool _sphere_touches_cluster(const vec3 &c, rtt2_float r, size_t tx, size_t ty, size_t sl) const {
+				rtt2_float
+					d[2]{ _get_slice_depth(sl), _get_slice_depth(sl + 1) },
+					nx[2]{ static_cast<rtt2_float>(2.0 * tx / tiles_x - 1.0), static_cast<rtt2_float>(2.0 * (tx + 1) / tiles_x - 1.0) },
+					ny[2]{ static_cast<rtt2_float>(2.0 * ty / tiles_y - 1.0), static_cast<rtt2_float>(2.0 * (ty + 1) / tiles_y - 1.0) };
+				vec3 bmin(INFINITY, INFINITY, -d[1]), bmax(-INFINITY, -INFINITY, -d[0]);
+				for (size_t i = 0; i < 2; ++i) {
+					rtt2_float z = -d[i], w = _proj[2][3] * z + _proj[3][3];
+					for (size_t j = 0; j < 2; ++j) {
+						rtt2_float
+							x = (nx[j] * w - _proj[2][0] * z - _proj[3][0]) / _proj[0][0],
+							y = (ny[j] * w - _proj[2][1] * z - _proj[3][1]) / _proj[1][1];
+						bmin.x = std::min(bmin.x, x);
+						bmax.x = std::max(bmax.x, x);
+						bmin.y = std::min(bmin.y, y);
+						bmax.y = std::max(bmax.y, y);
+					}
+				}
+				vec3 dv(
+					std::max<rtt2_float>(0.0, std::max(bmin.x - c.x, c.x - bmax.x)),
+					std::max<rtt2_float>(0.0, std::max(bmin.y - c.y, c.y - bmax.y)),
+					std::max<rtt2_float>(0.0, std::max(bmin.z - c.z, c.z - bmax.z))
+				);
+				return dv.sqr_length() <= r * r;
+			}
+		};
+
+		// the caches of point, spot & directional lights as structures of arrays indexed by light, so that the lights
+		// of a type are evaluated for a fragment in loops over plain arrays, without virtual calls
+		struct light_batches {
+			constexpr static size_t batch_size = 16; // the most lights that are evaluated at once
+
+			std::vector<light_type> types;
+			soa_vec3<rtt2_float> pos, dir, color;
+			std::vector<rtt2_float> range_sq, inner_cosv, outer_cosv;
+			std::vector<const light*> lights; // for the shadows
+			std::vector<size_t> all_ids; // 0 to the number of lights - 1
+
+			void build(const scene_description &scene, const std::vector<light_cache> &lc) {
+				size_t n = scene.lights.size();
+				types.resize(n);
+				lights.resize(n);
+				pos.resize(n);
+				dir.resize(n);
+				color.resize(n);
+				range_sq.resize(n);
+				inner_cosv.resize(n);
+				outer_cosv.resize(n);
+				all_ids.resize(n);
+				for (size_t i = 0; i < n; ++i) {
+					const light_data *d = scene.lights[i].data;
+					types[i] = d->get_type();
+					lights[i] = &scene.lights[i];
+					all_ids[i] = i;
+					if (types[i] == light_type::point) {
+						const point_light_data *pd = static_cast<const point_light_data*>(d);
+						_set(pos, i, lc[i].of_pointlight.pos);
+						_set(color, i, pd->color);
+						range_sq[i] = pd->range * pd->range;
+					} else if (types[i] == light_type::directional) {
+						_set(dir, i, lc[i].of_directional.dir);
+						_set(color, i, static_cast<const directional_light_data*>(d)->color);
+					} else if (types[i] == light_type::spot) {
+						const spot_light_data *sd = static_cast<const spot_light_data*>(d);
+						_set(pos, i, lc[i].of_spotlight.pos);
+						_set(dir, i, lc[i].of_spotlight.dir);
+						_set(color, i, sd->color);
+						range_sq[i] = sd->range * sd->range;
+						inner_cosv[i] = lc[i].of_spotlight.inner_cosv;
+						outer_cosv[i] = lc[i].of_spotlight.outer_cosv;
+					}
+				}
+			}
+
+			// the same as calling light_data::get_illum() with each of the n point lights, which are at most batch_size;
+			// the ids, directions & colors of the lights that reach fpos are put into rids, idirs & cols, and their
+			// number is returned
+			size_t get_point_illum(
+				const vec3 &fpos, const size_t *ids, size_t n, size_t *rids, vec3 *idirs, color_vec_rgb *cols
+			) const {
+				rtt2_float dx[batch_size], dy[batch_size], dz[batch_size], invsql[batch_size];
+				unsigned char lit[batch_size];
+				for (size_t k = 0; k < n; ++k) {
+					size_t i = ids[k];
+					dx[k] = fpos.x - pos.x[i];
+					dy[k] = fpos.y - pos.y[i];
+					dz[k] = fpos.z - pos.z[i];
+					rtt2_float sql = dx[k] * dx[k] + dy[k] * dy[k] + dz[k] * dz[k];
+					lit[k] = (sql <= range_sq[i]);
+					invsql[k] = 1.0 / sql;
+				}
+				size_t nr = 0;
+				for (size_t k = 0; k < n; ++k) {
+					if (lit[k]) {
+						rtt2_float s = std::sqrt(invsql[k]);
+						rids[nr] = ids[k];
+						idirs[nr] = vec3(dx[k] * s, dy[k] * s, dz[k] * s);
+						cols[nr] = color.get_at(ids[k]) * invsql[k];
+						++nr;
+					}
+				}
+				return nr;
+			}
+			// the same as get_point_illum(), for spot lights
+			size_t get_spot_illum(
+				const vec3 &fpos, const size_t *ids, size_t n, size_t *rids, vec3 *idirs, color_vec_rgb *cols
+			) const {
+				rtt2_float dx[batch_size], dy[batch_size], dz[batch_size], invsql[batch_size], dotv[batch_size];
+				unsigned char lit[batch_size];
+				for (size_t k = 0; k < n; ++k) {
+					size_t i = ids[k];
+					dx[k] = fpos.x - pos.x[i];
+					dy[k] = fpos.y - pos.y[i];
+					dz[k] = fpos.z - pos.z[i];
+					rtt2_float sql = dx[k] * dx[k] + dy[k] * dy[k] + dz[k] * dz[k];
+					invsql[k] = 1.0 / sql;
+					rtt2_float s = std::sqrt(invsql[k]);
+					dx[k] *= s;
+					dy[k] *= s;
+					dz[k] *= s;
+					dotv[k] = dx[k] * dir.x[i] + dy[k] * dir.y[i] + dz[k] * dir.z[i];
+					lit[k] = (sql <= range_sq[i] && dotv[k] >= outer_cosv[i]);
+				}
+				size_t nr = 0;
+				for (size_t k = 0; k < n; ++k) {
+					if (lit[k]) {
+						size_t i = ids[k];
+						rtt2_float mult = std::min<rtt2_float>(1.0, (dotv[k] - outer_cosv[i]) / (inner_cosv[i] - outer_cosv[i]));
+						rids[nr] = i;
+						idirs[nr] = vec3(dx[k], dy[k], dz[k]);
+						cols[nr] = color.get_at(i) * invsql[k] * mult;
+						++nr;
+					}
+				}
+				return nr;
+			}
+			// the same as get_point_illum(), for directional lights, which reach every point
+			size_t get_directional_illum(const size_t *ids, size_t n, size_t *rids, vec3 *idirs, color_vec_rgb *cols) const {
+				for (size_t k = 0; k < n; ++k) {
+					rids[k] = ids[k];
+					idirs[k] = dir.get_at(ids[k]);
+					cols[k] = color.get_at(ids[k]);
+				}
+				return n;
+			}
+			// the same as calling light::get_visibility() with each of the n lights, which are all of type T; the
+			// visibility of T is called directly
+			template <typename T> void get_visibility(const vec3 &fpos, const size_t *ids, size_t n, rtt2_float *vis) const {
+				for (size_t k = 0; k < n; ++k) {
+					const light &l = *lights[ids[k]];
+					vis[k] = (l.has_shadow ? static_cast<const T*>(l.data)->T::get_visibility(fpos, l.shadow_cache) : 1.0);
+				}
+			}
+		protected:
+			inline static void _set(soa_vec3<rtt2_float> &arr, size_t id, const vec3 &v) {
+				arr.x[id] = v.x;
+				arr.y[id] = v.y;
+				arr.z[id] = v.z;
+			}
+		};
 
 		class basic_renderer {
 		public:
@@ -29,6 +297,14 @@ namespace rtt2 {
 			const scene_description *scene = nullptr;
 			const mat4 *mat_modelview = nullptr, *mat_projection = nullptr;
 			scene_cache *cache = nullptr;
+			model_selection selection = model_selection::all; // the models that are refreshed & drawn
+			light_clusters *clusters = nullptr; // when set, it's built by refresh_cache(), and fragments only visit the lights of their clusters
+			light_batches *batches = nullptr; // when set, it's built by refresh_cache(), and the lights of built-in types are evaluated in batches
+			visibility_sample *visibility = nullptr; // the visibility buffer of setup_visibility_rendering_env(), as large as the color buffer
+
+			bool is_selected(const model &m) const {
+				return m.in_selection(selection);
+			}
 
 			struct additional_shader_info {
 				additional_shader_info() = default;
@@ -48,10 +324,10 @@ namespace rtt2 {
 			}
 			inline static bool renderer_shadow_test_shader(const rasterizer &r, rasterizer::frag_info &info, rtt2_float *z, unsigned char *st, void *tag) {
 				additional_shader_info *si = static_cast<additional_shader_info*>(tag);
-				if (si->r->scene->models[si->modid].enhance) {
-					if (!si->r->scene->models[si->modid].enhance->before_test_shader(
-						r, info, z, st, si->sc->of_models[si->modid].enhancement_face_cache.get_at(si->faceid)
-					)) {
+				const enhancement *enh = si->r->scene->models[si->modid].enhance;
+				if (enh) {
+					void *fdata = si->sc->of_models[si->modid].enhancement_face_cache.get_at(si->faceid);
+					if (enh->get_depth_bound(r, info, fdata) <= *z || !enh->before_test_shader(r, info, si->sc->of_models[si->modid].mat_cache, z, st, fdata)) {
 						return false;
 					}
 				}
@@ -62,10 +338,10 @@ namespace rtt2 {
 			}
 			inline static bool renderer_test_shader(const rasterizer &r, rasterizer::frag_info &info, rtt2_float *z, unsigned char *st, void *tag) {
 				additional_shader_info *si = static_cast<additional_shader_info*>(tag);
-				if (si->r->scene->models[si->modid].enhance) {
-					if (!si->r->scene->models[si->modid].enhance->before_test_shader(
-						r, info, z, st, si->sc->of_models[si->modid].enhancement_face_cache.get_at(si->faceid)
-					)) {
+				const enhancement *enh = si->r->scene->models[si->modid].enhance;
+				if (enh) {
+					void *fdata = si->sc->of_models[si->modid].enhancement_face_cache.get_at(si->faceid);
+					if (enh->get_depth_bound(r, info, fdata) <= *z || !enh->before_test_shader(r, info, si->sc->of_models[si->modid].mat_cache, z, st, fdata)) {
 						return false;
 					}
 				}
@@ -75,19 +351,99 @@ namespace rtt2 {
 				}
 				return false;
 			}
+			inline static void get_illum_of_light(
+				const rasterizer::frag_info &frag, const additional_shader_info &info, const vec3 &npos3, size_t i, color_vec_rgb &res
+			) {
+				vec3 in;
+				color_vec_rgb col, cr;
+				const light &curl = info.r->scene->lights[i];
+				if (curl.data->get_illum(info.sc->of_lights[i], frag.pos3_cache, in, col)) {
+					rtt2_float vis = curl.get_visibility(frag.pos3_cache);
+					if (vis > 0.0) {
+						info.r->scene->models[info.modid].mtrl->get_illum(in, npos3, frag.normal_cache, col, cr);
+						max_vec(cr, 0.0);
+						res += cr * vis;
+					}
+				}
+			}
+			// lights the fragment with the lit lights of a batch, which are all of type T; the lights that are in shadow
+			// are removed from idirs & cols
+			template <typename T> inline static void get_illum_of_batch(
+				const rasterizer::frag_info &frag, const additional_shader_info &info, const vec3 &npos3,
+				const size_t *ids, vec3 *idirs, color_vec_rgb *cols, size_t n, color_vec_rgb &res
+			) {
+				rtt2_float vis[light_batches::batch_size];
+				info.r->batches->get_visibility<T>(frag.pos3_cache, ids, n, vis);
+				size_t nv = 0;
+				for (size_t k = 0; k < n; ++k) {
+					if (vis[k] > 0.0) {
+						idirs[nv] = idirs[k];
+						cols[nv] = cols[k];
+						vis[nv] = vis[k];
+						++nv;
+					}
+				}
+				info.r->scene->models[info.modid].mtrl->add_illum_n(idirs, npos3, frag.normal_cache, cols, vis, nv, res);
+			}
+			// the same as calling get_illum_of_light() with each of the n lights, using the light_batches of the renderer
+			// the lights are summed by type, so the result can differ in rounding when the types are mixed
+			inline static void get_illum_of_lights(
+				const rasterizer::frag_info &frag, const additional_shader_info &info, const vec3 &npos3,
+				const size_t *ids, size_t n, color_vec_rgb &res
+			) {
+				constexpr size_t bsz = light_batches::batch_size;
+				const light_batches &lb = *info.r->batches;
+				size_t pts[bsz], spots[bsz], dirs[bsz], rids[bsz];
+				vec3 idirs[bsz];
+				color_vec_rgb cols[bsz];
+				for (size_t beg = 0; beg < n; beg += bsz) {
+					size_t end = std::min(n, beg + bsz), npts = 0, nspots = 0, ndirs = 0;
+					for (size_t j = beg; j < end; ++j) {
+						light_type t = lb.types[ids[j]];
+						if (t == light_type::point) {
+							pts[npts++] = ids[j];
+						} else if (t == light_type::spot) {
+							spots[nspots++] = ids[j];
+						} else if (t == light_type::directional) {
+							dirs[ndirs++] = ids[j];
+						} else {
+							get_illum_of_light(frag, info, npos3, ids[j], res);
+						}
+					}
+					get_illum_of_batch<point_light_data>(
+						frag, info, npos3, rids, idirs, cols, lb.get_point_illum(frag.pos3_cache, pts, npts, rids, idirs, cols), res
+					);
+					get_illum_of_batch<spot_light_data>(
+						frag, info, npos3, rids, idirs, cols, lb.get_spot_illum(frag.pos3_cache, spots, nspots, rids, idirs, cols), res
+					);
+					get_illum_of_batch<directional_light_data>(
+						frag, info, npos3, rids, idirs, cols, lb.get_directional_illum(dirs, ndirs, rids, idirs, cols), res
+					);
+				}
+			}
 			inline static void get_illum_of_frag(const rasterizer::frag_info &frag, const additional_shader_info &info, color_vec_rgb &res) {
-				vec3 npos3(-frag.pos3_cache), norm(frag.normal_cache);
+				vec3 npos3(-frag.pos3_cache);
 				npos3.set_length(1.0);
-				for (size_t i = 0; i < info.r->scene->lights.size(); ++i) {
-					vec3 in;
-					color_vec_rgb col, cr;
-					const light &curl = info.r->scene->lights[i];
-					if (curl.data->get_illum(info.sc->of_lights[i], frag.pos3_cache, in, col)) {
-						if (!curl.in_shadow(frag.pos3_cache)) {
-							info.r->scene->models[info.modid].mtrl->get_illum(in, npos3, norm, col, cr);
-							max_vec(cr, 0.0);
-							res += cr;
-						}
+				const light_clusters *cl = info.r->clusters;
+				if (info.r->batches) {
+					if (cl) {
+						size_t c = cl->get_cluster(frag.pos3_cache, frag.pos4_cache);
+						get_illum_of_lights(frag, info, npos3, cl->light_ids.data() + cl->offsets[c], cl->offsets[c + 1] - cl->offsets[c], res);
+						get_illum_of_lights(frag, info, npos3, cl->global_lights.data(), cl->global_lights.size(), res);
+					} else {
+						get_illum_of_lights(frag, info, npos3, info.r->batches->all_ids.data(), info.r->batches->all_ids.size(), res);
+					}
+				} else if (cl) {
+					size_t c = cl->get_cluster(frag.pos3_cache, frag.pos4_cache);
+					for (size_t j = cl->offsets[c]; j < cl->offsets[c + 1]; ++j) {
+						get_illum_of_light(frag, info, npos3, cl->light_ids[j], res);
+					}
+					for (auto j = cl->global_lights.begin(); j != cl->global_lights.end(); ++j) {
+						get_illum_of_light(frag, info, npos3, *j, res);
+					}
+				} else {
+					for (size_t i = 0; i < info.r->scene->lights.size(); ++i) {
+						get_illum_of_light(frag, info, npos3, i, res);
 					}
 				}
 			}
@@ -98,7 +454,7 @@ namespace rtt2 {
 				color_vec_rgb c1;
 				color_vec c2;
 				if (tex) {
-					sample(*tex, frag.uv_cache, c2);
+					sample_texture(*tex, frag.uv_cache, frag.duv_dx_cache, frag.duv_dy_cache, c2);
 				} else {
 					c2 = vec4(1.0, 1.0, 1.0, 1.0);
 				}
@@ -131,7 +487,7 @@ namespace rtt2 {
 				get_illum_of_frag(frag, *info, res);
 				color_vec c1;
 				if (tex) {
-					sample(*tex, frag.uv_cache, c1);
+					sample_texture(*tex, frag.uv_cache, frag.duv_dx_cache, frag.duv_dy_cache, c1);
 					c1 = vec_mult(vec_mult(c1, vec4(res, 1.0)), frag.color_mult_cache);
 				} else {
 					c1 = vec_mult(vec4(res, 1.0), frag.color_mult_cache);
@@ -139,6 +495,30 @@ namespace rtt2 {
 				clamp_vec(c1, 0.0, 1.0);
 				cres->from_vec4(c1);
 			}
+			// writes the visibility buffer of the renderer instead of colors; the buffers mustn't have msaa, since the
+			// visibility buffer holds a single sample per pixel
+			inline static void renderer_fragment_shader_visibility(
+				const rasterizer &r, const rasterizer::frag_info &frag, const texture*,
+				device_color*, void *pinfo
+			) {
+				additional_shader_info *info = static_cast<additional_shader_info*>(pinfo);
+				const model_data::index_cache_data &ic = info->r->scene->models[info->modid].data->index_cache;
+				const model_data::indexed_face &f = ic.faces[info->faceid];
+				const std::vector<vertex_pos_cache> &pc = info->sc->of_models[info->modid].pos_cache;
+				const vec3 &p0 = pc[ic.vertices[f.vertex_ids[0]].point_id].shaded_pos;
+				vec3
+					e1 = pc[ic.vertices[f.vertex_ids[1]].point_id].shaded_pos - p0,
+					e2 = pc[ic.vertices[f.vertex_ids[2]].point_id].shaded_pos - p0,
+					d = frag.pos3_cache - p0;
+				rtt2_float
+					d11 = vec3::dot(e1, e1), d12 = vec3::dot(e1, e2), d22 = vec3::dot(e2, e2),
+					d1 = vec3::dot(d, e1), d2 = vec3::dot(d, e2), inv = 1.0 / (d11 * d22 - d12 * d12);
+				visibility_sample &vs = info->r->visibility[r.cur_buf.w * frag.y + frag.x];
+				vs.model = info->modid;
+				vs.face = info->faceid;
+				vs.u = (d22 * d1 - d12 * d2) * inv;
+				vs.v = (d11 * d2 - d12 * d1) * inv;
+			}
 			void setup_custom_rendering_env(
 				rasterizer::vertex_shader vs,
 				rasterizer::test_shader ts,
@@ -171,27 +551,65 @@ namespace rtt2 {
 					renderer_fragment_shader_compact
 				);
 			}
+			void setup_visibility_rendering_env() {
+				if (linked_rasterizer->cur_buf.has_msaa()) {
+					throw std::invalid_argument("visibility buffers can't be rendered with msaa");
+				}
+				setup_custom_rendering_env(
+					renderer_vertex_shader,
+					renderer_test_shader,
+					renderer_fragment_shader_visibility
+				);
+			}
+			// marks every pixel of the visibility buffer as empty
+			void clear_visibility() {
+				const buffer_set &bs = linked_rasterizer->cur_buf;
+				for (size_t i = bs.w * bs.h; i > 0; ) {
+					--i;
+					visibility[i].model = visibility_sample::no_model;
+				}
+			}
+
+			typedef rasterizer::static_pipeline<renderer_vertex_shader, renderer_test_shader, renderer_fragment_shader> default_pipeline;
+			typedef rasterizer::static_pipeline<renderer_vertex_shader, renderer_shadow_test_shader, nullptr> shadow_pipeline;
+			typedef rasterizer::static_pipeline<renderer_vertex_shader, rasterizer::default_test_shader, renderer_fragment_shader_compact> compact_pipeline;
+			typedef rasterizer::static_pipeline<renderer_vertex_shader, renderer_test_shader, renderer_fragment_shader_visibility> visibility_pipeline;
 
 			void render_cached() {
 				render_cached(*cache);
 			}
 			void render_cached(const scene_cache &sc) {
+				render_cached<rasterizer::dynamic_pipeline>(sc);
+			}
+			template <typename Pipeline> void render_cached() {
+				render_cached<Pipeline>(*cache);
+			}
+			template <typename Pipeline> void render_cached(const scene_cache &sc) {
 				additional_shader_info fi(this, &sc);
 				const model *mod = &scene->models[0];
 				for (fi.modid = 0; fi.modid < scene->models.size(); ++fi.modid, ++mod) {
-					fi.faceid = 0;
-					const model_data::face_info *curface = &mod->data->faces[0];
-					for (size_t j = 0; j < mod->data->faces.size(); ++j, ++fi.faceid, ++curface) {
-						linked_rasterizer->draw_cached_triangle(
-							sc.of_models[fi.modid].pos_cache[curface->vertex_ids[0]],
-							sc.of_models[fi.modid].pos_cache[curface->vertex_ids[1]],
-							sc.of_models[fi.modid].pos_cache[curface->vertex_ids[2]],
-							sc.of_models[fi.modid].normal_cache[curface->normal_ids[0]],
-							sc.of_models[fi.modid].normal_cache[curface->normal_ids[1]],
-							sc.of_models[fi.modid].normal_cache[curface->normal_ids[2]],
-							mod->data->uvs[curface->uv_ids[0]],
-							mod->data->uvs[curface->uv_ids[1]],
-							mod->data->uvs[curface->uv_ids[2]],
+					if (!is_selected(*mod)) {
+						continue;
+					}
+					const model_cache &mc = sc.of_models[fi.modid];
+					const model_data::index_cache_data &ic = mod->data->index_cache;
+					for (auto j = mc.visible_faces.begin(); j != mc.visible_faces.end(); ++j) {
+						fi.faceid = *j;
+						const model_data::indexed_face &curface = ic.faces[*j];
+						const model_data::indexed_vertex
+							&v1 = ic.vertices[curface.vertex_ids[0]],
+							&v2 = ic.vertices[curface.vertex_ids[1]],
+							&v3 = ic.vertices[curface.vertex_ids[2]];
+						linked_rasterizer->draw_cached_triangle_no_backface_culling<Pipeline>(
+							mc.pos_cache[v1.point_id],
+							mc.pos_cache[v2.point_id],
+							mc.pos_cache[v3.point_id],
+							mc.normal_cache[v1.normal_id],
+							mc.normal_cache[v2.normal_id],
+							mc.normal_cache[v3.normal_id],
+							mod->data->uvs[v1.uv_id],
+							mod->data->uvs[v2.uv_id],
+							mod->data->uvs[v3.uv_id],
 							mod->color,
 							mod->color,
 							mod->color,
@@ -203,38 +621,155 @@ namespace rtt2 {
 			}
 
 			void render_nocache() {
+				render_nocache<rasterizer::dynamic_pipeline>();
+			}
+			template <typename Pipeline> void render_nocache() {
 				scene_cache sc;
 				init_cache(sc);
 				refresh_cache(sc);
-				render_cached(sc);
+				render_cached<Pipeline>(sc);
 			}
 
+			// model_data::make_index_cache() must have been called after the last change of the faces, otherwise
+			// the model would silently render nothing
 			inline static void init_cache_of_model(const model &m, model_cache &tg) {
-				tg.pos_cache = std::vector<vertex_pos_cache>(m.data->points.size());
-				tg.normal_cache = std::vector<vertex_normal_cache>(m.data->normals.size());
+				if (m.data->index_cache.faces.size() != m.data->faces.size()) {
+					throw std::invalid_argument("index cache of the model is out of date");
+				}
+				tg.pos_cache = std::vector<vertex_pos_cache>(m.data->index_cache.points.size());
+				tg.normal_cache = std::vector<vertex_normal_cache>(m.data->index_cache.normals.size());
+				tg.pos_batch.resize(tg.pos_cache.size());
+				tg.pos_valid = std::vector<unsigned char>(tg.pos_cache.size());
+				tg.normal_valid = std::vector<unsigned char>(tg.normal_cache.size());
+				tg.cluster_visible = std::vector<unsigned char>(m.data->index_cache.cluster_bounds.size());
+				tg.face_visible = std::vector<unsigned char>(m.data->faces.size());
+				tg.visible_faces.reserve(m.data->faces.size());
+				tg.dirty = true;
 				if (m.enhance) {
 					tg.enhancement_face_cache.reset(m.enhance->get_additional_face_data_size(), m.data->faces.size());
 				}
 			}
-			void refresh_cache_of_model(const model &m, model_cache &tg) const {
-				mat4::mult_ref(*mat_modelview, *m.trans, tg.mat_cache);
-				for (size_t i = 0; i < m.data->points.size(); ++i) {
-					transform_default(tg.mat_cache, m.data->points[i], tg.pos_cache[i].shaded_pos);
-					tg.pos_cache[i].complete(*mat_projection);
+			// the face caches of the enhancement are made in object space, so they only change with the geometry
+			void make_enhancement_cache_of_model(const model &m, model_cache &tg) const {
+				const model_data::index_cache_data &ic = m.data->index_cache;
+				int nfaces = static_cast<int>(ic.faces.size());
+#pragma omp parallel for
+				for (int i = 0; i < nfaces; ++i) {
+					vertex_pos_cache pos[3];
+					vertex_normal_cache normal[3];
+					rasterizer::vertex_info vi[3];
+					for (size_t d = 0; d < 3; ++d) {
+						const model_data::indexed_vertex &iv = ic.vertices[ic.faces[i].vertex_ids[d]];
+						pos[d].shaded_pos = m.data->points[ic.points[iv.point_id]];
+						normal[d].shaded_normal = m.data->normals[ic.normals[iv.normal_id]];
+						vi[d].pos = &pos[d];
+						vi[d].normal = &normal[d];
+						vi[d].uv = &m.data->uvs[iv.uv_id];
+						vi[d].c = &m.color;
+					}
+					m.enhance->make_face_cache(vi, tg.enhancement_face_cache.get_at(i));
 				}
-				for (size_t i = 0; i < m.data->normals.size(); ++i) {
-					transform_default(tg.mat_cache, m.data->normals[i], tg.normal_cache[i].shaded_normal, 0.0);
+			}
+			// whole models and clusters of faces outside the frustum are skipped; otherwise positions are only processed
+			// for vertices referenced by faces, and normals only for faces that are neither back-facing
+			// nor completely outside of one of the frustum planes
+			// nothing is done if neither the transforms nor the model have changed since the last refresh
+			// each pass either runs in parallel, or only marks & gathers the elements that the next pass works on
+			// points are first transformed in batches from the float copies in the index cache, skipping batches that
+			// contain no referenced point; pos_cache is only filled in afterwards for the points of the visible faces
+			// pts can hold the points of the index cache already transformed by some matrix, shared between several
+			// refreshes; mpts then takes them from there into view space
+			void refresh_cache_of_model(const model &m, model_cache &tg, const soa_vec3f *pts = nullptr, const mat4 *mpts = nullptr) const {
+				const model_data::index_cache_data &ic = m.data->index_cache;
+				constexpr size_t cluster_size = model_data::index_cache_data::cluster_size;
+				constexpr size_t batch_size = vertex_pos_batch_cache::batch_size;
+				mat4 mc;
+				mat4::mult_ref(*mat_modelview, *m.trans, mc);
+				if (!tg.dirty && mc == tg.mat_cache && *mat_projection == tg.mat_proj_cache) {
+					return;
 				}
-				if (m.enhance) {
-					rasterizer::vertex_info vi[3];
-					vi[0].c = vi[1].c = vi[2].c = &m.color;
-					for (size_t i = 0; i < m.data->faces.size(); ++i) {
+				if (tg.dirty && m.enhance) {
+					make_enhancement_cache_of_model(m, tg);
+				}
+				tg.dirty = false;
+				tg.mat_cache = mc;
+				tg.mat_proj_cache = *mat_projection;
+				tg.visible_faces.clear();
+				frustum fr;
+				fr.set(*mat_projection * tg.mat_cache);
+				if (fr.is_outside(ic.bounds)) {
+					return;
+				}
+
+				int nclusters = static_cast<int>(ic.cluster_bounds.size()), nfaces = static_cast<int>(ic.faces.size());
+#pragma omp parallel for
+				for (int c = 0; c < nclusters; ++c) {
+					tg.cluster_visible[c] = !fr.is_outside(ic.cluster_bounds[c]);
+				}
+				std::fill(tg.pos_valid.begin(), tg.pos_valid.end(), 0);
+				for (size_t i = 0; i < ic.faces.size(); ++i) {
+					if (!tg.cluster_visible[i / cluster_size]) {
+						i += cluster_size - 1;
+						continue;
+					}
+					for (size_t d = 0; d < 3; ++d) {
+						tg.pos_valid[ic.vertices[ic.faces[i].vertex_ids[d]].point_id] = 1;
+					}
+				}
+				int nbatches = static_cast<int>((tg.pos_batch.size() + batch_size - 1) / batch_size);
+#pragma omp parallel for
+				for (int b = 0; b < nbatches; ++b) {
+					size_t beg = b * batch_size, n = std::min(batch_size, tg.pos_batch.size() - beg);
+					if (std::find(tg.pos_valid.begin() + beg, tg.pos_valid.begin() + beg + n, 1) != tg.pos_valid.begin() + beg + n) {
+						tg.pos_batch.set(pts ? *mpts : tg.mat_cache, *mat_projection, pts ? *pts : ic.point_coords, beg, n);
+					}
+				}
+				vec4 eye = get_projection_eye(*mat_projection); // a face is back-facing when the eye is behind its plane
+				bool ortho_eye = (eye.x != 0.0 || eye.y != 0.0 || eye.z != 0.0);
+#pragma omp parallel for
+				for (int i = 0; i < nfaces; ++i) {
+					tg.face_visible[i] = 0;
+					if (!tg.cluster_visible[i / cluster_size]) {
+						continue;
+					}
+					size_t
+						p0 = ic.vertices[ic.faces[i].vertex_ids[0]].point_id,
+						p1 = ic.vertices[ic.faces[i].vertex_ids[1]].point_id,
+						p2 = ic.vertices[ic.faces[i].vertex_ids[2]].point_id;
+					if ((tg.pos_batch.clip_code[p0] & tg.pos_batch.clip_code[p1] & tg.pos_batch.clip_code[p2]) != 0) {
+						continue;
+					}
+					vec3 s0 = tg.pos_batch.get_shaded_pos(p0), s1 = tg.pos_batch.get_shaded_pos(p1), s2 = tg.pos_batch.get_shaded_pos(p2);
+					rtt2_float side = eye.w * vec3::dot(s0, vec3::cross(s1, s2));
+					if (ortho_eye) {
+						side -= vec3::dot(eye.xyz(), vec3::cross(s1 - s0, s2 - s0));
+					}
+					tg.face_visible[i] = (side <= 0.0);
+				}
+				std::fill(tg.pos_valid.begin(), tg.pos_valid.end(), 0);
+				std::fill(tg.normal_valid.begin(), tg.normal_valid.end(), 0);
+				for (size_t i = 0; i < ic.faces.size(); ++i) {
+					if (tg.face_visible[i]) {
+						tg.visible_faces.push_back(i);
 						for (size_t d = 0; d < 3; ++d) {
-							vi[d].normal = &tg.normal_cache[m.data->faces[i].normal_ids[d]];
-							vi[d].pos = &tg.pos_cache[m.data->faces[i].vertex_ids[d]];
-							vi[d].uv = &m.data->uvs[m.data->faces[i].uv_ids[d]];
+							const model_data::indexed_vertex &iv = ic.vertices[ic.faces[i].vertex_ids[d]];
+							tg.pos_valid[iv.point_id] = 1;
+							tg.normal_valid[iv.normal_id] = 1;
 						}
-						m.enhance->make_face_cache(vi, tg.enhancement_face_cache.get_at(i));
+					}
+				}
+				int npoints = static_cast<int>(tg.pos_cache.size());
+#pragma omp parallel for
+				for (int i = 0; i < npoints; ++i) {
+					if (tg.pos_valid[i]) {
+						tg.pos_batch.get(i, *mat_projection, tg.pos_cache[i]);
+					}
+				}
+				int nnormals = static_cast<int>(tg.normal_cache.size());
+#pragma omp parallel for
+				for (int i = 0; i < nnormals; ++i) {
+					if (tg.normal_valid[i]) {
+						transform_default(tg.mat_cache, m.data->normals[ic.normals[i]], tg.normal_cache[i].shaded_normal, 0.0);
 					}
 				}
 			}
@@ -247,7 +782,9 @@ namespace rtt2 {
 				sc.of_models = std::vector<model_cache>(scene->models.size());
 				sc.of_lights = std::vector<light_cache>(scene->lights.size());
 				for (size_t i = 0; i < scene->models.size(); ++i) {
-					init_cache_of_model(scene->models[i], sc.of_models[i]);
+					if (is_selected(scene->models[i])) {
+						init_cache_of_model(scene->models[i], sc.of_models[i]);
+					}
 				}
 			}
 			void init_cache() {
@@ -255,27 +792,104 @@ namespace rtt2 {
 			}
 			void refresh_cache(scene_cache &sc) const {
 				for (size_t i = 0; i < scene->models.size(); ++i) {
-					refresh_cache_of_model(scene->models[i], sc.of_models[i]);
+					if (is_selected(scene->models[i])) {
+						refresh_cache_of_model(scene->models[i], sc.of_models[i]);
+					}
 				}
 				for (size_t i = 0; i < scene->lights.size(); ++i) {
 					refresh_cache_of_light(scene->lights[i], sc.of_lights[i]);
 				}
+				if (clusters) {
+					clusters->build(*scene, sc.of_lights, *mat_projection);
+				}
+				if (batches) {
+					batches->build(*scene, sc.of_lights);
+				}
 			}
 			void refresh_cache() {
 				refresh_cache(*cache);
 			}
 		};
 
+		// replaces each depth in bs with exp(-exponent * d), where d is the linear depth, and blurs the result with a
+		// separable box filter, whose edges are clamped
+		inline void make_exponential_shadow_map(const buffer_set &bs, const mat4 &proj, const shadow_filter &f) {
+			int w = static_cast<int>(bs.w), h = static_cast<int>(bs.h), r = static_cast<int>(f.radius);
+			rtt2_float inv = 1.0 / (2 * r + 1);
+			std::vector<rtt2_float> tmp(bs.w * bs.h);
+#pragma omp parallel for
+			for (int y = 0; y < h; ++y) {
+				rtt2_float *row = bs.get_at(0, y, bs.depth_arr);
+				for (int x = 0; x < w; ++x) {
+					row[x] = std::exp(-f.exponent * get_linear_shadow_depth(proj, row[x]));
+				}
+				for (int x = 0; x < w; ++x) {
+					rtt2_float sum = 0.0;
+					for (int d = -r; d <= r; ++d) {
+						sum += row[clamp(x + d, 0, w - 1)];
+					}
+					tmp[y * w + x] = sum * inv;
+				}
+			}
+#pragma omp parallel for
+			for (int y = 0; y < h; ++y) {
+				rtt2_float *row = bs.get_at(0, y, bs.depth_arr);
+				for (int x = 0; x < w; ++x) {
+					rtt2_float sum = 0.0;
+					for (int d = -r; d <= r; ++d) {
+						sum += tmp[clamp(y + d, 0, h - 1) * w + x];
+					}
+					row[x] = sum * inv;
+				}
+			}
+		}
+		inline void check_shadow_filter(const shadow_filter &f) {
+			if (f.mode == shadow_filter_mode::pcf && f.radius > shadow_filter::max_pcf_radius) {
+				throw std::invalid_argument("pcf kernel too large");
+			}
+		}
+
+		// clears the depth buffer of bs and draws the selected models into it
+		inline void render_shadow_layer(
+			const scene_description &scene,
+			const buffer_set &bs,
+			const mat4 &mdlv,
+			const mat4 &proj,
+			model_selection sel,
+			const shadow_filter &f
+		) {
+			basic_renderer rend;
+			rasterizer rast;
+
+			rast.cur_buf = bs;
+			rast.clear_depth_buf(-1.0);
+
+			rend.scene = &scene;
+			rend.linked_rasterizer = &rast;
+			rend.mat_modelview = &mdlv;
+			rend.mat_projection = &proj;
+			rend.selection = sel;
+
+			rend.setup_shadow_rendering_env();
+			rend.render_nocache<basic_renderer::shadow_pipeline>();
+			if (f.mode == shadow_filter_mode::exponential) {
+				make_exponential_shadow_map(bs, proj, f);
+			}
+		}
+		// the models in the main layer of a shadow map whose dynamic layer is dyn
+		inline model_selection get_static_layer_selection(const buffer_set &dyn) {
+			return (dyn.depth_arr ? model_selection::static_only : model_selection::all);
+		}
+
 		inline void spot_light_data::build_shadow_cache(
 			const scene_description &scene,
 			const buffer_set *bs,
+			const buffer_set *dyn,
 			const shadow_settings &settings,
 			light::shadow_data &sd
 		) const {
 			mat4 mdlv, proj;
 			vec3 up, right;
-			basic_renderer rend;
-			rasterizer rast;
 
 			dir.get_max_prp(up);
 			up.set_length(1.0);
@@ -283,60 +897,233 @@ namespace rtt2 {
 			get_trans_camview_3(pos, dir, up, right, mdlv);
 			get_trans_frustrum_3(2.0 * outer_angle, 1.0, settings.of_spotlight.znear, settings.of_spotlight.zfar, proj);
 
-			rast.cur_buf = *bs;
+			check_shadow_filter(settings.of_spotlight.filter);
+			sd.of_spotlight.set(scene, mdlv, proj, *bs, dyn, settings.of_spotlight.tolerance, settings.of_spotlight.filter);
+			render_shadow_layer(scene, *bs, mdlv, proj, get_static_layer_selection(sd.of_spotlight.dyn_buff), sd.of_spotlight.filter);
+			refresh_shadow_cache(sd);
+		}
+		inline void spot_light_data::refresh_shadow_cache(light::shadow_data &sd) const {
+			if (sd.of_spotlight.dyn_buff.depth_arr) {
+				render_shadow_layer(*sd.of_spotlight.scene, sd.of_spotlight.dyn_buff, sd.of_spotlight.mat_view, sd.of_spotlight.mat_proj, model_selection::dynamic_only, sd.of_spotlight.filter);
+			}
+		}
+
+		template <size_t Id> inline void point_light_data::_build_shadow_cache_face(
+			const scene_description &scene,
+			const buffer_set *bs,
+			const std::vector<soa_vec3f> &rel,
+			const mat4 &t1,
+			const mat4 &proj,
+			model_selection sel
+		) {
+			mat4 rot, mdlv;
+			basic_renderer rend;
+			rasterizer rast;
+			scene_cache sc;
+
+			set_rot_mat<Id>(rot);
+			mat4::mult_ref(rot, t1, mdlv);
+			rast.cur_buf = bs[Id];
 			rast.clear_depth_buf(-1.0);
 
 			rend.scene = &scene;
 			rend.linked_rasterizer = &rast;
 			rend.mat_modelview = &mdlv;
 			rend.mat_projection = &proj;
+			rend.selection = sel;
 
+			sc.of_models = std::vector<model_cache>(scene.models.size());
+			for (size_t i = 0; i < scene.models.size(); ++i) {
+				if (rend.is_selected(scene.models[i])) {
+					rend.init_cache_of_model(scene.models[i], sc.of_models[i]);
+					rend.refresh_cache_of_model(scene.models[i], sc.of_models[i], &rel[i], &rot);
+				}
+			}
 			rend.setup_shadow_rendering_env();
-			rend.render_nocache();
-
-			sd.of_spotlight.set(mdlv, proj, *bs, settings.of_spotlight.tolerance);
+			rend.render_cached<basic_renderer::shadow_pipeline>(sc);
 		}
-
-		template <size_t Id> inline void point_light_data::_build_shadow_cache_face(
+		// the points of the selected models are moved relative to the light once, and only rotated for each face
+		// the faces are rendered in parallel, each culling the scene against its own frustum
+		inline void point_light_data::_build_shadow_layer(
+			const scene_description &scene,
 			const buffer_set *bs,
-			basic_renderer &rend,
-			mat4 &mdl,
-			const mat4 &t1
-		) {
-			mat4 t2;
-			rend.linked_rasterizer->cur_buf = bs[Id];
-			rend.linked_rasterizer->clear_depth_buf(-1.0);
-			set_rot_mat<Id>(t2);
-			mat4::mult_ref(t2, t1, mdl);
-			rend.setup_shadow_rendering_env();
-			rend.render_nocache();
+			const mat4 &proj,
+			model_selection sel,
+			const shadow_filter &f
+		) const {
+			mat4 t1;
+			std::vector<soa_vec3f> rel(scene.models.size());
+
+			get_trans_translation_3(-pos, t1);
+			for (size_t i = 0; i < scene.models.size(); ++i) {
+				if (!scene.models[i].in_selection(sel)) {
+					continue;
+				}
+				const soa_vec3f &src = scene.models[i].data->index_cache.point_coords;
+				mat4 mrel;
+				mat4::mult_ref(t1, *scene.models[i].trans, mrel);
+				rel[i].resize(src.size());
+				int nbatches = static_cast<int>((src.size() + vertex_pos_batch_cache::batch_size - 1) / vertex_pos_batch_cache::batch_size);
+#pragma omp parallel for
+				for (int b = 0; b < nbatches; ++b) {
+					size_t beg = b * vertex_pos_batch_cache::batch_size, n = std::min(vertex_pos_batch_cache::batch_size, src.size() - beg);
+					transform_batch(mrel, src, beg, n, rel[i].x.data() + beg, rel[i].y.data() + beg, rel[i].z.data() + beg);
+				}
+			}
+
+#pragma omp parallel for
+			for (int i = 0; i < 6; ++i) {
+				switch (i) {
+					case 0:
+						_build_shadow_cache_face<0>(scene, bs, rel, t1, proj, sel);
+						break;
+					case 1:
+						_build_shadow_cache_face<1>(scene, bs, rel, t1, proj, sel);
+						break;
+					case 2:
+						_build_shadow_cache_face<2>(scene, bs, rel, t1, proj, sel);
+						break;
+					case 3:
+						_build_shadow_cache_face<3>(scene, bs, rel, t1, proj, sel);
+						break;
+					case 4:
+						_build_shadow_cache_face<4>(scene, bs, rel, t1, proj, sel);
+						break;
+					case 5:
+						_build_shadow_cache_face<5>(scene, bs, rel, t1, proj, sel);
+						break;
+				}
+			}
+			if (f.mode == shadow_filter_mode::exponential) {
+				for (size_t i = 0; i < 6; ++i) {
+					make_exponential_shadow_map(bs[i], proj, f);
+				}
+			}
 		}
 		inline void point_light_data::build_shadow_cache(
 			const scene_description &scene,
 			const buffer_set *bs,
+			const buffer_set *dyn,
 			const shadow_settings &settings,
 			light::shadow_data &sd
 		) const {
-			mat4 mdlv, t1;
-			basic_renderer rend;
-			rasterizer rast;
-
-			get_trans_translation_3(-pos, t1);
 			get_trans_frustrum_3(0.5 * RTT2_PI, 1.0, settings.of_pointlight.znear, settings.of_pointlight.zfar, sd.of_pointlight.mat_proj);
+			check_shadow_filter(settings.of_pointlight.filter);
+			sd.of_pointlight.set(scene, bs, dyn, settings.of_pointlight.tolerance, settings.of_pointlight.filter);
+			_build_shadow_layer(scene, bs, sd.of_pointlight.mat_proj, get_static_layer_selection(sd.of_pointlight.dyn_buff[0]), sd.of_pointlight.filter);
+			refresh_shadow_cache(sd);
+		}
+		inline void point_light_data::refresh_shadow_cache(light::shadow_data &sd) const {
+			if (sd.of_pointlight.dyn_buff[0].depth_arr) {
+				_build_shadow_layer(*sd.of_pointlight.scene, sd.of_pointlight.dyn_buff, sd.of_pointlight.mat_proj, model_selection::dynamic_only, sd.of_pointlight.filter);
+			}
+		}
 
-			rend.scene = &scene;
-			rend.linked_rasterizer = &rast;
-			rend.mat_modelview = &mdlv;
-			rend.mat_projection = &sd.of_pointlight.mat_proj;
+		inline void directional_light_data::build_shadow_cache(
+			const scene_description &scene,
+			const buffer_set *bs,
+			const buffer_set *dyn,
+			const shadow_settings &settings,
+			light::shadow_data &sd
+		) const {
+			if (settings.of_directional.cascades == 0 || settings.of_directional.cascades > light::max_cascades) {
+				throw std::invalid_argument("invalid number of cascades"); // the buffers are copied into fixed-size arrays
+			}
+			check_shadow_filter(settings.of_directional.filter);
+			sd.of_directional.set(scene, bs, dyn, settings);
+		}
+		// the cascades are fitted & their static layers rendered in set_camera_mat(), so this only redraws the dynamic layers
+		inline void directional_light_data::refresh_shadow_cache(light::shadow_data &sd) const {
+			auto &dd = sd.of_directional;
+			if (!dd.dyn_buff[0].depth_arr) {
+				return;
+			}
+			mat4 lview;
+			get_view_mat(lview);
+			int ncascades = static_cast<int>(dd.cascades);
+#pragma omp parallel for
+			for (int i = 0; i < ncascades; ++i) {
+				if (dd.valid[i]) {
+					render_shadow_layer(*dd.scene, dd.dyn_buff[i], lview, dd.mat_proj[i], model_selection::dynamic_only, dd.filter);
+				}
+			}
+		}
+		// the camera frustum is split between logarithmic & uniform splits, and each cascade is fitted to the bounding
+		// sphere of its slice, whose size doesn't change when the camera rotates
+		// the cascades are snapped to whole texels in the light's view, and their depth ranges cover all models, so
+		// that moving the camera only changes a cascade after it has moved by a texel
+		// the depth range is only fitted again when a model leaves it, and all static layers are rendered again when
+		// the transform of a model in them changes
+		inline void directional_light_data::set_camera_mat(const mat4 &mt, light::shadow_data &sd) const {
+			auto &dd = sd.of_directional;
+			mat4 inv, lview, c2l;
+			mt.get_inversion(inv);
+			get_view_mat(lview);
+			mat4::mult_ref(lview, inv, c2l);
+
+			model_selection sel = get_static_layer_selection(dd.dyn_buff[0]);
+			rtt2_float zmin = INFINITY, zmax = -INFINITY;
+			unsigned long long casters = 14695981039346656037ull;
+			for (auto i = dd.scene->models.begin(); i != dd.scene->models.end(); ++i) {
+				const aabb3 &b = i->data->index_cache.bounds;
+				mat4 m2l;
+				mat4::mult_ref(lview, *i->trans, m2l);
+				for (size_t c = 0; c < 8; ++c) {
+					vec3 p;
+					transform_default(m2l, vec3(c & 1 ? b.max.x : b.min.x, c & 2 ? b.max.y : b.min.y, c & 4 ? b.max.z : b.min.z), p);
+					zmin = std::min(zmin, p.z);
+					zmax = std::max(zmax, p.z);
+				}
+				if (i->in_selection(sel)) {
+					const unsigned char *bytes = reinterpret_cast<const unsigned char*>(i->trans);
+					for (size_t k = 0; k < sizeof(mat4); ++k) {
+						casters = (casters ^ bytes[k]) * 1099511628211ull;
+					}
+				}
+			}
+			if (casters != dd.casters_hash) { // a caster of the static layers has moved
+				std::memset(dd.valid, 0, sizeof(dd.valid));
+				dd.casters_hash = casters;
+			}
+			if (zmin < dd.depth_min || zmax > dd.depth_max) {
+				rtt2_float zpad = std::max<rtt2_float>(0.01 * (zmax - zmin), RTT2_EPSILON);
+				dd.depth_min = zmin - zpad;
+				dd.depth_max = zmax + zpad;
+			}
 
-			_build_shadow_cache_face<0>(bs, rend, mdlv, t1);
-			_build_shadow_cache_face<1>(bs, rend, mdlv, t1);
-			_build_shadow_cache_face<2>(bs, rend, mdlv, t1);
-			_build_shadow_cache_face<3>(bs, rend, mdlv, t1);
-			_build_shadow_cache_face<4>(bs, rend, mdlv, t1);
-			_build_shadow_cache_face<5>(bs, rend, mdlv, t1);
+			rtt2_float xmult = std::tan(0.5 * dd.hori_fov), ymult = xmult * dd.aspect_ratio, prev = dd.znear;
+			int redraw[light::max_cascades], nredraw = 0;
+			for (size_t i = 0; i < dd.cascades; ++i) {
+				rtt2_float
+					frac = (i + 1) / static_cast<rtt2_float>(dd.cascades),
+					split_end = dd.split_lambda * dd.znear * std::pow(dd.zfar / dd.znear, frac) + (1.0 - dd.split_lambda) * (dd.znear + (dd.zfar - dd.znear) * frac),
+					mid = 0.5 * (prev + split_end),
+					rnear = vec3(prev * xmult, prev * ymult, mid - prev).length(),
+					rfar = vec3(split_end * xmult, split_end * ymult, split_end - mid).length(),
+					r = std::max(rnear, rfar),
+					texelx = 2.0 * r / dd.buff[i].w, texely = 2.0 * r / dd.buff[i].h;
+				dd.split_far[i] = split_end;
+				prev = split_end;
 
-			sd.of_pointlight.set(bs, settings.of_pointlight.tolerance);
+				vec3 center;
+				transform_default(c2l, vec3(0.0, 0.0, -mid), center);
+				center.x = std::floor(center.x / texelx) * texelx;
+				center.y = std::floor(center.y / texely) * texely;
+				mat4 proj, w2sm;
+				get_trans_orthographic_3(center.x - r, center.x + r, center.y - r, center.y + r, -dd.depth_max, -dd.depth_min, proj);
+				mat4::mult_ref(proj, lview, w2sm);
+				if (!dd.valid[i] || w2sm != dd.mat_w2sm[i]) {
+					dd.mat_w2sm[i] = w2sm;
+					dd.mat_proj[i] = proj;
+					dd.valid[i] = true;
+					redraw[nredraw++] = static_cast<int>(i);
+				}
+				mat4::mult_ref(dd.mat_w2sm[i], inv, dd.mat_tot[i]);
+			}
+#pragma omp parallel for
+			for (int i = 0; i < nredraw; ++i) {
+				render_shadow_layer(*dd.scene, dd.buff[redraw[i]], lview, dd.mat_proj[redraw[i]], get_static_layer_selection(dd.dyn_buff[0]), dd.filter);
+			}
 		}
 	}
 }
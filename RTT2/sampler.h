@@ -0,0 +1,160 @@
+#pragma once
+
+#include "settings.h"
+#include "utils.h"
+#include "vec.h"
+#include "color.h"
+#include "texture.h"
+
+namespace rtt2 {
+	// lerps all four channels of two packed colors, two channels per multiplication
+	// f is in [0, 256], so each channel stays below 0x10000 and can't spill into its neighbour
+	inline DWORD lerp_packed(DWORD a, DWORD b, DWORD f) {
+		DWORD
+			rb = ((a & 0x00FF00FF) * (256 - f) + (b & 0x00FF00FF) * f) >> 8,
+			ag = ((a >> 8) & 0x00FF00FF) * (256 - f) + ((b >> 8) & 0x00FF00FF) * f;
+		return (rb & 0x00FF00FF) | (ag & 0xFF00FF00);
+	}
+
+	// samplers with the wrap & filter modes fixed at compile time, reading the base level only
+	// sample() gives the same results as texture::sample(); sample_packed() filters the 8-bit texels directly,
+	// with weights quantized to 1 / 256, and ignores the float cache, so it's only used for textures that opt in
+	// with texture::packed_filtering
+	template <uv_clamp_mode Wrap, sample_mode Filter> struct texture_sampler {
+	};
+	template <uv_clamp_mode Wrap> struct texture_sampler<Wrap, sample_mode::nearest> {
+		inline static void get_coords(const texture &tex, const vec2 &uv, int &x, int &y) {
+			x = static_cast<int>(std::floor(uv.x * tex.get_w()));
+			y = static_cast<int>(std::floor(uv.y * tex.get_h()));
+			coord_wrapper<Wrap>::wrap(x, tex.get_w());
+			coord_wrapper<Wrap>::wrap(y, tex.get_h());
+		}
+
+		inline static void sample(const texture &tex, const vec2 &uv, color_vec &res) {
+			int x, y;
+			get_coords(tex, uv, x, y);
+			tex.fetch(x, y, res);
+		}
+		inline static device_color sample_packed(const texture &tex, const vec2 &uv) {
+			int x, y;
+			get_coords(tex, uv, x, y);
+			return *tex.get_at(x, y);
+		}
+
+		template <size_t N> inline static void sample_n(const texture &tex, const vec2 *uv, color_vec *res) {
+			for (size_t i = 0; i < N; ++i) {
+				sample(tex, uv[i], res[i]);
+			}
+		}
+		template <size_t N> inline static void sample_packed_n(const texture &tex, const vec2 *uv, device_color *res) {
+			for (size_t i = 0; i < N; ++i) {
+				res[i] = sample_packed(tex, uv[i]);
+			}
+		}
+		inline static void sample4(const texture &tex, const vec2 *uv, color_vec *res) {
+			sample_n<4>(tex, uv, res);
+		}
+		inline static void sample8(const texture &tex, const vec2 *uv, color_vec *res) {
+			sample_n<8>(tex, uv, res);
+		}
+		inline static void sample_packed4(const texture &tex, const vec2 *uv, device_color *res) {
+			sample_packed_n<4>(tex, uv, res);
+		}
+		inline static void sample_packed8(const texture &tex, const vec2 *uv, device_color *res) {
+			sample_packed_n<8>(tex, uv, res);
+		}
+	};
+	template <uv_clamp_mode Wrap> struct texture_sampler<Wrap, sample_mode::bilinear> {
+		inline static void sample(const texture &tex, const vec2 &uv, color_vec &res) {
+			tex.sample_bilinear<Wrap>(0, uv, res);
+		}
+		inline static device_color sample_packed(const texture &tex, const vec2 &uv) {
+			device_color res;
+			sample_packed_n<1>(tex, &uv, &res);
+			return res;
+		}
+
+		// the coordinates & weights of the whole batch are computed before any texel is read
+		template <size_t N> inline static void sample_n(const texture &tex, const vec2 *uv, color_vec *res) {
+			int x[N], y[N], x1[N], y1[N];
+			rtt2_float fx[N], fy[N];
+			_get_footprints<N>(tex, uv, x, y, x1, y1, fx, fy);
+			for (size_t i = 0; i < N; ++i) {
+				color_vec v0, v1, v2, v3;
+				tex.fetch(x[i], y[i], v0);
+				tex.fetch(x1[i], y[i], v1);
+				tex.fetch(x[i], y1[i], v2);
+				tex.fetch(x1[i], y1[i], v3);
+				res[i] = v0 + (v1 - v0) * (1.0 - fy[i]) * fx[i] + (v2 - v0 + (v3 - v2) * fx[i]) * fy[i];
+			}
+		}
+		template <size_t N> inline static void sample_packed_n(const texture &tex, const vec2 *uv, device_color *res) {
+			int x[N], y[N], x1[N], y1[N];
+			rtt2_float fx[N], fy[N];
+			_get_footprints<N>(tex, uv, x, y, x1, y1, fx, fy);
+			for (size_t i = 0; i < N; ++i) {
+				DWORD
+					wx = static_cast<DWORD>(fx[i] * 256.0 + 0.5), wy = static_cast<DWORD>(fy[i] * 256.0 + 0.5),
+					top = lerp_packed(tex.get_at(x[i], y[i])->argb, tex.get_at(x1[i], y[i])->argb, wx),
+					bottom = lerp_packed(tex.get_at(x[i], y1[i])->argb, tex.get_at(x1[i], y1[i])->argb, wx);
+				res[i].argb = lerp_packed(top, bottom, wy);
+			}
+		}
+		inline static void sample4(const texture &tex, const vec2 *uv, color_vec *res) {
+			sample_n<4>(tex, uv, res);
+		}
+		inline static void sample8(const texture &tex, const vec2 *uv, color_vec *res) {
+			sample_n<8>(tex, uv, res);
+		}
+		inline static void sample_packed4(const texture &tex, const vec2 *uv, device_color *res) {
+			sample_packed_n<4>(tex, uv, res);
+		}
+		inline static void sample_packed8(const texture &tex, const vec2 *uv, device_color *res) {
+			sample_packed_n<8>(tex, uv, res);
+		}
+	protected:
+		template <size_t N> inline static void _get_footprints(
+			const texture &tex, const vec2 *uv, int *x, int *y, int *x1, int *y1, rtt2_float *fx, rtt2_float *fy
+		) {
+			for (size_t i = 0; i < N; ++i) {
+				fx[i] = uv[i].x * tex.get_w() - 0.5;
+				fy[i] = uv[i].y * tex.get_h() - 0.5;
+				x[i] = static_cast<int>(std::floor(fx[i]));
+				y[i] = static_cast<int>(std::floor(fy[i]));
+				fx[i] -= x[i];
+				fy[i] -= y[i];
+				x1[i] = x[i] + 1;
+				y1[i] = y[i] + 1;
+			}
+			for (size_t i = 0; i < N; ++i) {
+				coord_wrapper<Wrap>::wrap(x[i], tex.get_w());
+				coord_wrapper<Wrap>::wrap(x1[i], tex.get_w());
+				coord_wrapper<Wrap>::wrap(y[i], tex.get_h());
+				coord_wrapper<Wrap>::wrap(y1[i], tex.get_h());
+			}
+		}
+	};
+
+	template <uv_clamp_mode Wrap> inline void sample_base_level(const texture &tex, const vec2 &uv, color_vec &res) {
+		if (tex.mode_sample == sample_mode::nearest) {
+			texture_sampler<Wrap, sample_mode::nearest>::sample(tex, uv, res);
+		} else if (tex.packed_filtering) {
+			texture_sampler<Wrap, sample_mode::bilinear>::sample_packed(tex, uv).to_vec4(res);
+		} else {
+			texture_sampler<Wrap, sample_mode::bilinear>::sample(tex, uv, res);
+		}
+	}
+	// the same as texture::sample(), with nearest & bilinear textures sampled by the texture_sampler of their modes,
+	// which are only switched on once
+	inline void sample_texture(const texture &tex, const vec2 &uv, const vec2 &duvdx, const vec2 &duvdy, color_vec &res) {
+		if (tex.mode_sample == sample_mode::trilinear || tex.mode_sample == sample_mode::anisotropic) {
+			tex.sample(uv, duvdx, duvdy, res);
+		} else if (tex.mode_uv == uv_clamp_mode::repeat) {
+			sample_base_level<uv_clamp_mode::repeat>(tex, uv, res);
+		} else if (tex.mode_uv == uv_clamp_mode::repeat_border) {
+			sample_base_level<uv_clamp_mode::repeat_border>(tex, uv, res);
+		} else {
+			sample_base_level<uv_clamp_mode::rev_repeat>(tex, uv, res);
+		}
+	}
+}
@@ -0,0 +1,140 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+
+#include "settings.h"
+#include "utils.h"
+#include "mat.h"
+#include "buffer.h"
+#include "light.h"
+
+namespace rtt2 {
+	namespace rasterizing {
+		// a single depth texture that the shadow maps of all lights are allocated from
+		// the atlas is a quadtree of square regions whose sides are powers of two, stored so that each region is
+		// contiguous in memory & can be rendered into as a buffer_set of its own
+		class shadow_atlas {
+		public:
+			shadow_atlas(size_t side, size_t min_side) : _side(side), _min_side(min_side), _depth(side * side) {
+#ifdef DEBUG
+				if ((side & (side - 1)) != 0 || (min_side & (min_side - 1)) != 0 || min_side == 0 || min_side > side) {
+					throw std::invalid_argument("invalid atlas size");
+				}
+#endif
+				size_t levels = 1;
+				for (size_t s = side; s > min_side; s >>= 1) {
+					++levels;
+				}
+				_free.resize(levels);
+				reset();
+			}
+
+			size_t get_side() const {
+				return _side;
+			}
+			size_t get_min_side() const {
+				return _min_side;
+			}
+
+			// frees all regions; the shadows of lights whose regions aren't allocated again must be turned off
+			void reset() {
+				for (auto i = _free.begin(); i != _free.end(); ++i) {
+					i->clear();
+				}
+				_free[0].push_back(0);
+			}
+			// allocates a square region, whose side is rounded up to a power of two
+			bool allocate(size_t side, buffer_set &res) {
+				size_t level = _get_level(side), l = level + 1;
+				for (; l > 0 && _free[l - 1].empty(); --l) {
+				}
+				if (l == 0) {
+					return false;
+				}
+				--l;
+				size_t off = _free[l].back();
+				_free[l].pop_back();
+				for (; l < level; ++l) {
+					size_t child = _get_area(l + 1);
+					for (size_t c = 3; c > 0; --c) {
+						_free[l + 1].push_back(off + c * child);
+					}
+				}
+				size_t rside = _side >> level;
+				res.set(rside, rside, nullptr, _depth.data() + off, nullptr);
+				return true;
+			}
+			// allocates n regions of the same size, or none of them
+			bool allocate(size_t side, size_t n, buffer_set *res) {
+				for (size_t i = 0; i < n; ++i) {
+					if (!allocate(side, res[i])) {
+						for (; i > 0; --i) {
+							release(res[i - 1]);
+						}
+						return false;
+					}
+				}
+				return true;
+			}
+			// frees a region, merging it with its siblings when they're all free
+			void release(const buffer_set &bs) {
+				size_t level = _get_level(bs.w), off = static_cast<size_t>(bs.depth_arr - _depth.data());
+				for (; level > 0; --level) {
+					size_t area = _get_area(level), first = off - (off / area) % 4 * area;
+					std::vector<size_t> &fl = _free[level];
+					size_t nsiblings = 0;
+					for (size_t c = 0; c < 4; ++c) {
+						if (first + c * area != off && std::find(fl.begin(), fl.end(), first + c * area) != fl.end()) {
+							++nsiblings;
+						}
+					}
+					if (nsiblings < 3) {
+						break;
+					}
+					fl.erase(std::remove_if(fl.begin(), fl.end(), [first, area](size_t v) {
+						return v >= first && v < first + 4 * area;
+					}), fl.end());
+					off = first;
+				}
+				_free[level].push_back(off);
+			}
+
+			// the side of the regions of a light with the given importance, the largest being max_side
+			size_t get_region_side(rtt2_float importance, size_t max_side) const {
+				rtt2_float target = max_side * std::sqrt(clamp<rtt2_float>(importance, 0.0, 1.0));
+				size_t side = _min_side;
+				for (; side * 2 <= target && side * 2 <= _side; side <<= 1) {
+				}
+				return side;
+			}
+			// sizes the shadow maps of a light by its importance for the camera, and allocates them, halving their side
+			// until they fit; returns the side of the maps, or 0 when even the smallest ones don't fit
+			size_t allocate_for(const light &l, const mat4 &mdlv, const mat4 &proj, const shadow_settings &set, size_t max_side, buffer_set *res) {
+				size_t n = l.data->get_shadow_map_count(set);
+				for (size_t side = get_region_side(l.data->get_shadow_importance(mdlv, proj, set), max_side); side >= _min_side; side >>= 1) {
+					if (allocate(side, n, res)) {
+						return side;
+					}
+				}
+				return 0;
+			}
+		protected:
+			size_t _side, _min_side;
+			std::vector<rtt2_float> _depth;
+			std::vector<std::vector<size_t>> _free; // the offsets of the free regions at each level of the quadtree
+
+			size_t _get_level(size_t side) const {
+				size_t level = 0;
+				for (size_t s = _side; s > _min_side && s / 2 >= side; s >>= 1) {
+					++level;
+				}
+				return level;
+			}
+			size_t _get_area(size_t level) const {
+				return (_side >> level) * (_side >> level);
+			}
+		};
+	}
+}
@@ -0,0 +1,145 @@
+#pragma once
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+
+#include "settings.h"
+#include "utils.h"
+#include "vec.h"
+#include "mat.h"
+#include "color.h"
+#include "buffer.h"
+
+namespace rtt2 {
+	namespace rasterizing {
+		// averages rendered frames with the frames before them, so that stochastic effects can take few samples per frame
+		// & converge over time; the history is reprojected with the transforms of the previous frame, & it's rejected
+		// where the depth of the surface doesn't match, e.g. where it was occluded or off screen
+		class temporal_accumulation {
+		public:
+			size_t max_frames = 16; // the most frames that are averaged; older frames fade out exponentially after that
+			rtt2_float depth_tolerance = 0.02; // the largest relative difference of view depths of a matching surface
+			bool clamp_history = false; // clamps the history to the colors around each pixel, which removes ghosting but keeps noise
+
+			// forgets the history, e.g. when the scene changes
+			void reset() {
+				_valid = false;
+			}
+			// blends the color buffer of bs, whose depth buffer was rendered with mdlv & proj, with the history, & writes
+			// the result back to it; the result becomes the history of the next frame
+			void accumulate(const buffer_set &bs, const mat4 &mdlv, const mat4 &proj) {
+				size_t n = bs.w * bs.h;
+				if (bs.w != _w || bs.h != _h) {
+					_w = bs.w;
+					_h = bs.h;
+					_color.resize(n);
+					_depth.resize(n);
+					_frames.resize(n);
+					_next_color.resize(n);
+					_next_depth.resize(n);
+					_next_frames.resize(n);
+					_valid = false;
+				}
+				mat4 invproj, invmdlv, rel;
+				proj.get_inversion(invproj);
+				if (_valid) { // from the view space of this frame to the one of the previous frame
+					mdlv.get_inversion(invmdlv);
+					mat4::mult_ref(_prev_mdlv, invmdlv, rel);
+				}
+				int h = static_cast<int>(bs.h);
+#pragma omp parallel for
+				for (int y = 0; y < h; ++y) {
+					for (size_t x = 0; x < bs.w; ++x) {
+						size_t id = y * bs.w + x;
+						rtt2_float nx, ny;
+						bs.normalize_scr_coord(x, y, nx, ny);
+						vec3 pos;
+						(invproj * vec4(nx, ny, *bs.get_at(x, y, bs.depth_arr), 1.0)).homogenize_3(pos);
+						vec4 cur;
+						bs.get_at(x, y, bs.color_arr)->to_vec4(cur);
+						color_vec_rgb res = cur.xyz();
+						size_t frames = 1;
+						color_vec_rgb hist;
+						size_t hframes;
+						if (_valid && _get_history(rel, pos, hist, hframes)) {
+							if (clamp_history) {
+								_clamp_to_neighbors(bs, x, y, hist);
+							}
+							frames = std::min(hframes + 1, max_frames);
+							res = hist + (res - hist) * (1.0 / frames);
+						}
+						_next_color[id] = res;
+						_next_depth[id] = pos.z;
+						_next_frames[id] = frames;
+					}
+				}
+#pragma omp parallel for
+				for (int y = 0; y < h; ++y) {
+					for (size_t x = 0; x < bs.w; ++x) {
+						device_color *dc = bs.get_at(x, y, bs.color_arr);
+						vec4 c;
+						dc->to_vec4(c);
+						c = vec4(_next_color[y * bs.w + x], c.w);
+						clamp_vec(c, 0.0, 1.0);
+						dc->from_vec4(c);
+					}
+				}
+				_color.swap(_next_color);
+				_depth.swap(_next_depth);
+				_frames.swap(_next_frames);
+				_prev_mdlv = mdlv;
+				_prev_proj = proj;
+				_valid = true;
+			}
+		protected:
+			size_t _w = 0, _h = 0;
+			mat4 _prev_mdlv, _prev_proj;
+			bool _valid = false;
+			std::vector<color_vec_rgb> _color, _next_color;
+			std::vector<rtt2_float> _depth, _next_depth; // in the view space of the frame
+			std::vector<size_t> _frames, _next_frames; // the number of frames that each pixel averages
+
+			// the history at a point in view space, which rel takes to the view space of the previous frame, filtered
+			// bilinearly; false when it's rejected
+			bool _get_history(const mat4 &rel, const vec3 &pos, color_vec_rgb &res, size_t &frames) const {
+				vec3 prev;
+				transform_default(rel, pos, prev);
+				vec4 cp = _prev_proj * vec4(prev);
+				if (cp.w <= 0.0) {
+					return false;
+				}
+				rtt2_float px = (cp.x / cp.w + 1.0) * 0.5 * _w - 0.5, py = (cp.y / cp.w + 1.0) * 0.5 * _h - 0.5;
+				if (px < -0.5 || py < -0.5 || px >= _w - 0.5 || py >= _h - 0.5) {
+					return false;
+				}
+				size_t nid = static_cast<size_t>(py + 0.5) * _w + static_cast<size_t>(px + 0.5);
+				if (std::abs(_depth[nid] - prev.z) > depth_tolerance * std::abs(prev.z)) {
+					return false;
+				}
+				px = clamp<rtt2_float>(px, 0.0, _w - 1.0);
+				py = clamp<rtt2_float>(py, 0.0, _h - 1.0);
+				size_t x0 = static_cast<size_t>(px), y0 = static_cast<size_t>(py), x1 = std::min(x0 + 1, _w - 1), y1 = std::min(y0 + 1, _h - 1);
+				rtt2_float fx = px - x0, fy = py - y0;
+				res =
+					(_color[y0 * _w + x0] * (1.0 - fx) + _color[y0 * _w + x1] * fx) * (1.0 - fy) +
+					(_color[y1 * _w + x0] * (1.0 - fx) + _color[y1 * _w + x1] * fx) * fy;
+				frames = _frames[nid];
+				return true;
+			}
+			// clamps the color to the box around the 3x3 colors of the current frame around the pixel
+			inline static void _clamp_to_neighbors(const buffer_set &bs, size_t x, size_t y, color_vec_rgb &c) {
+				color_vec_rgb cmin(INFINITY, INFINITY, INFINITY), cmax(-INFINITY, -INFINITY, -INFINITY);
+				for (size_t ny = (y > 0 ? y - 1 : 0); ny <= y + 1 && ny < bs.h; ++ny) {
+					for (size_t nx = (x > 0 ? x - 1 : 0); nx <= x + 1 && nx < bs.w; ++nx) {
+						vec4 v;
+						bs.get_at(nx, ny, bs.color_arr)->to_vec4(v);
+						cmin = vec3(std::min(cmin.x, v.x), std::min(cmin.y, v.y), std::min(cmin.z, v.z));
+						cmax = vec3(std::max(cmax.x, v.x), std::max(cmax.y, v.y), std::max(cmax.z, v.z));
+					}
+				}
+				clamp_vec(c, cmin, cmax);
+			}
+		};
+	}
+}
@@ -2,6 +2,12 @@
 
 #include <string>
 #include <fstream>
+#include <cstring>
+#include <cstdlib>
+#include <cctype>
+#include <vector>
+#include <cmath>
+#include <algorithm>
 
 #include "color.h"
 #include "buffer.h"
@@ -12,35 +18,60 @@ namespace rtt2 {
 		rev_repeat,
 		repeat_border
 	};
+	enum class texture_layout {
+		linear,
+		tiled // square tiles of texels, stored row by row; each tile is a cache line for 8-bit texels
+	};
 	enum class sample_mode {
 		nearest,
-		bilinear
+		bilinear,
+		trilinear, // the following modes need the mip chain & uv derivatives, and fall back to bilinear otherwise
+		anisotropic
+	};
+
+	// uv_clamp_mode as a compile-time parameter
+	template <uv_clamp_mode Mode> struct coord_wrapper {
+	};
+	template <> struct coord_wrapper<uv_clamp_mode::repeat> {
+		inline static void wrap(int &v, size_t max) {
+			v %= static_cast<int>(max);
+			if (v < 0) {
+				v += static_cast<int>(max);
+			}
+		}
+	};
+	template <> struct coord_wrapper<uv_clamp_mode::repeat_border> {
+		inline static void wrap(int &v, size_t max) {
+			if (v < 0) {
+				v = 0;
+			} else if (static_cast<size_t>(v) >= max) {
+				v = max - 1;
+			}
+		}
+	};
+	template <> struct coord_wrapper<uv_clamp_mode::rev_repeat> {
+		inline static void wrap(int &v, size_t max) {
+			int dm = max * 2;
+			v %= dm;
+			if (v < 0) {
+				v += dm;
+			}
+			if (static_cast<size_t>(v) >= max) {
+				v = dm - v - 1;
+			}
+		}
 	};
 
 	inline void clamp_coords(int &v, size_t max, uv_clamp_mode mode) {
 		switch (mode) {
 			case uv_clamp_mode::repeat:
-				v %= static_cast<int>(max);
-				if (v < 0) {
-					v += static_cast<int>(max);
-				}
+				coord_wrapper<uv_clamp_mode::repeat>::wrap(v, max);
 				break;
 			case uv_clamp_mode::repeat_border:
-				if (v < 0) {
-					v = 0;
-				} else if (static_cast<size_t>(v) >= max) {
-					v = max - 1;
-				}
+				coord_wrapper<uv_clamp_mode::repeat_border>::wrap(v, max);
 				break;
 			case uv_clamp_mode::rev_repeat:
-				int dm = max * 2;
-				v %= dm;
-				if (v < 0) {
-					v += dm;
-				}
-				if (static_cast<size_t>(v) >= max) {
-					v = dm - v - 1;
-				}
+				coord_wrapper<uv_clamp_mode::rev_repeat>::wrap(v, max);
 				break;
 		}
 	}
@@ -55,6 +86,8 @@ namespace rtt2 {
 				break;
 			}
 			case sample_mode::bilinear:
+			case sample_mode::trilinear:
+			case sample_mode::anisotropic:
 			{
 				rtt2_float xf = uv.x * src.get_w() - 0.5, yf = uv.y * src.get_h() - 0.5;
 				int x = static_cast<int>(std::floor(xf)), y = static_cast<int>(std::floor(yf)), x1 = x + 1, y1 = y + 1;
@@ -92,6 +125,9 @@ namespace rtt2 {
 
 		uv_clamp_mode mode_uv = uv_clamp_mode::repeat;
 		sample_mode mode_sample = sample_mode::bilinear;
+		rtt2_float max_anisotropy = 8.0;
+		// bilinear textures are filtered on their 8-bit texels by sample_texture(), with weights quantized to 1 / 256
+		bool packed_filtering = false;
 
 		size_t get_w() const {
 			return _w;
@@ -105,13 +141,19 @@ namespace rtt2 {
 		color_vec *get_arr_vec() const {
 			return _carr_cache;
 		}
+		size_t get_mip_count() const {
+			return _mips.size() + 1;
+		}
+		texture_layout get_layout() const {
+			return _layout;
+		}
 		device_color *get_at(size_t x, size_t y) const {
 #ifdef DEBUG
 			if (x >= _w || y >= _h) {
 				throw std::range_error("texel fetch coord out of bounds");
 			}
 #endif
-			return _arr + (_w * y + x);
+			return _arr + _get_texel_index(x, y);
 		}
 		color_vec *get_vec_at(size_t x, size_t y) const {
 #ifdef DEBUG
@@ -119,15 +161,20 @@ namespace rtt2 {
 				throw std::range_error("texel fetch coord out of bounds");
 			}
 #endif
-			return _carr_cache + (_w * y + x);
+			return _carr_cache + _get_texel_index(x, y);
 		}
+		// reads the float cache if there is one, otherwise converts the 8-bit texel
 		void fetch(size_t x, size_t y, color_vec &res) const {
 #ifdef DEBUG
 			if (x >= _w || y >= _h) {
 				throw std::range_error("texel fetch coord out of bounds");
 			}
 #endif
-			res = *get_vec_at(x, y);
+			if (_carr_cache) {
+				res = _carr_cache[_get_texel_index(x, y)];
+			} else {
+				_arr[_get_texel_index(x, y)].to_vec4(res);
+			}
 		}
 		void grad_x(const vec2 &uv, color_vec &res, uv_clamp_mode clampm) const {
 			int x = static_cast<int>(std::floor(uv.x * _w)), y = static_cast<int>(std::floor(uv.y * _h)), x1 = x + 1;
@@ -170,25 +217,74 @@ namespace rtt2 {
 					break;
 				}
 				case sample_mode::bilinear:
+				case sample_mode::trilinear:
+				case sample_mode::anisotropic:
+					_sample_bilinear(0, uv, res, clampm);
+					break;
+			}
+		}
+		// duvdx & duvdy are the differences of uv between neighbouring pixels, used to select the mip level
+		void sample(const vec2 &uv, const vec2 &duvdx, const vec2 &duvdy, color_vec &res, uv_clamp_mode clampm, sample_mode sampm) const {
+			switch (sampm) {
+				case sample_mode::trilinear:
 				{
-					rtt2_float xf = uv.x * _w - 0.5, yf = uv.y * _h - 0.5;
-					int x = static_cast<int>(std::floor(xf)), y = static_cast<int>(std::floor(yf)), x1 = x + 1, y1 = y + 1;
-					xf -= x;
-					yf -= y;
-					clamp_coords(x, _w, clampm);
-					clamp_coords(x1, _w, clampm);
-					clamp_coords(y, _h, clampm);
-					clamp_coords(y1, _h, clampm);
-					vec4 v[4];
-					fetch(x, y, v[0]);
-					fetch(x1, y, v[1]);
-					fetch(x, y1, v[2]);
-					fetch(x1, y1, v[3]);
-					res = v[0] + (v[1] - v[0]) * (1.0 - yf) * xf + (v[2] - v[0] + (v[3] - v[2]) * xf) * yf;
+					vec2 dx(duvdx.x * _w, duvdx.y * _h), dy(duvdy.x * _w, duvdy.y * _h);
+					_sample_trilinear(0.5 * std::log2(std::max(dx.sqr_length(), dy.sqr_length())), uv, res, clampm);
 					break;
 				}
+				case sample_mode::anisotropic:
+				{ // several trilinear samples along the major axis of the footprint, at the level of the minor axis
+					vec2 dx(duvdx.x * _w, duvdx.y * _h), dy(duvdy.x * _w, duvdy.y * _h);
+					rtt2_float lx = dx.sqr_length(), ly = dy.sqr_length();
+					if (!std::isfinite(lx) || !std::isfinite(ly)) { // degenerate footprints, e.g. at the horizon
+						_sample_bilinear(_mips.size(), uv, res, clampm);
+						break;
+					}
+					if (std::max(lx, ly) <= 1.0) { // magnified
+						_sample_bilinear(0, uv, res, clampm);
+						break;
+					}
+					vec2 axis = (lx > ly ? duvdx : duvdy);
+					rtt2_float
+						major = std::sqrt(std::max(lx, ly)), minor = std::sqrt(std::min(lx, ly)),
+						ratio = (major > max_anisotropy * minor ? max_anisotropy : (minor > 0.0 ? major / minor : 1.0)),
+						lod = std::log2(major / ratio);
+					size_t n = static_cast<size_t>(std::ceil(ratio));
+					res = color_vec(0.0, 0.0, 0.0, 0.0);
+					for (size_t i = 0; i < n; ++i) {
+						color_vec c;
+						_sample_trilinear(lod, uv + axis * ((i + 0.5) / n - 0.5), c, clampm);
+						res += c;
+					}
+					res /= static_cast<rtt2_float>(n);
+					break;
+				}
+				default:
+					sample(uv, res, clampm, sampm);
+					break;
 			}
 		}
+		void sample(const vec2 &uv, const vec2 &duvdx, const vec2 &duvdy, color_vec &res) const {
+			sample(uv, duvdx, duvdy, res, mode_uv, mode_sample);
+		}
+		template <uv_clamp_mode Wrap> void sample_bilinear(size_t level, const vec2 &uv, color_vec &res) const {
+			_level_view lv = _get_level(level);
+			size_t w = lv.w, h = lv.h;
+			rtt2_float xf = uv.x * w - 0.5, yf = uv.y * h - 0.5;
+			int x = static_cast<int>(std::floor(xf)), y = static_cast<int>(std::floor(yf)), x1 = x + 1, y1 = y + 1;
+			xf -= x;
+			yf -= y;
+			coord_wrapper<Wrap>::wrap(x, w);
+			coord_wrapper<Wrap>::wrap(x1, w);
+			coord_wrapper<Wrap>::wrap(y, h);
+			coord_wrapper<Wrap>::wrap(y1, h);
+			color_vec v0, v1, v2, v3;
+			lv.load(x, y, v0);
+			lv.load(x1, y, v1);
+			lv.load(x, y1, v2);
+			lv.load(x1, y1, v3);
+			res = v0 + (v1 - v0) * (1.0 - yf) * xf + (v2 - v0 + (v3 - v2) * xf) * yf;
+		}
 
 		void reset(size_t w, size_t h) {
 			_free_mem();
@@ -196,6 +292,7 @@ namespace rtt2 {
 			_h = h;
 			_arr = new device_color[_w * _h];
 			_carr_cache = nullptr;
+			_layout = texture_layout::linear;
 		}
 		void reset() {
 			_free_mem();
@@ -203,6 +300,7 @@ namespace rtt2 {
 			_carr_cache = nullptr;
 		}
 
+		// the float cache is only needed for texels that don't fit in 8 bits, e.g. HDR images
 		void make_float_cache() {
 			if (_carr_cache) {
 				delete[] _carr_cache;
@@ -210,111 +308,343 @@ namespace rtt2 {
 			make_float_cache_nocheck();
 		}
 		void make_float_cache_nocheck() {
-			_carr_cache = new color_vec[_w * _h];
+			_carr_cache = new color_vec[_get_storage_size(_w, _h, _layout)];
 			color_vec *c = _carr_cache;
 			device_color *d = _arr;
-			for (size_t i = _w * _h; i > 0; --i, ++c, ++d) {
+			for (size_t i = _get_storage_size(_w, _h, _layout); i > 0; --i, ++c, ++d) {
 				d->to_vec4(*c);
 			}
+			make_mipmaps();
+		}
+		// rearranges the texels, the float cache and the mip chain; borrowed storage is copied
+		void set_layout(texture_layout layout) {
+			if (layout == _layout) {
+				return;
+			}
+			device_color *narr = new device_color[_get_storage_size(_w, _h, layout)];
+			color_vec *ncarr = (_carr_cache ? new color_vec[_get_storage_size(_w, _h, layout)] : nullptr);
+			for (size_t y = 0; y < _h; ++y) {
+				for (size_t x = 0; x < _w; ++x) {
+					size_t from = _get_texel_index(x, y), to = _get_texel_index(x, y, _w, layout);
+					narr[to] = _arr[from];
+					if (ncarr) {
+						ncarr[to] = _carr_cache[from];
+					}
+				}
+			}
+			bool hasmips = !_mips.empty();
+			_free_mem();
+			_arr = narr;
+			_carr_cache = ncarr;
+			_own = true;
+			_layout = layout;
+			if (hasmips) {
+				make_mipmaps();
+			}
+		}
+		// box-filters the texels down to 1x1, in the same format as the base level
+		void make_mipmaps() {
+			_mips.clear();
+			_level_view src = _get_level(0);
+			while (src.w > 1 || src.h > 1) {
+				_mip_level lvl;
+				lvl.w = std::max<size_t>(src.w / 2, 1);
+				lvl.h = std::max<size_t>(src.h / 2, 1);
+				if (src.farr) {
+					lvl.float_texels.resize(_get_storage_size(lvl.w, lvl.h, _layout));
+				} else {
+					lvl.texels.resize(_get_storage_size(lvl.w, lvl.h, _layout));
+				}
+				for (size_t y = 0; y < lvl.h; ++y) {
+					size_t y0 = std::min(y * 2, src.h - 1), y1 = std::min(y * 2 + 1, src.h - 1);
+					for (size_t x = 0; x < lvl.w; ++x) {
+						size_t x0 = std::min(x * 2, src.w - 1), x1 = std::min(x * 2 + 1, src.w - 1);
+						size_t
+							i = _get_texel_index(x, y, lvl.w, _layout),
+							i00 = src.get_index(x0, y0), i01 = src.get_index(x1, y0),
+							i10 = src.get_index(x0, y1), i11 = src.get_index(x1, y1);
+						if (src.farr) {
+							lvl.float_texels[i] = (src.farr[i00] + src.farr[i01] + src.farr[i10] + src.farr[i11]) * 0.25;
+						} else {
+							const device_color &c00 = src.arr[i00], &c01 = src.arr[i01], &c10 = src.arr[i10], &c11 = src.arr[i11];
+							lvl.texels[i].set(
+								static_cast<unsigned char>((c00.get_a() + c01.get_a() + c10.get_a() + c11.get_a() + 2) / 4),
+								static_cast<unsigned char>((c00.get_r() + c01.get_r() + c10.get_r() + c11.get_r() + 2) / 4),
+								static_cast<unsigned char>((c00.get_g() + c01.get_g() + c10.get_g() + c11.get_g() + 2) / 4),
+								static_cast<unsigned char>((c00.get_b() + c01.get_b() + c10.get_b() + c11.get_b() + 2) / 4)
+							);
+						}
+					}
+				}
+				_mips.push_back(std::move(lvl));
+				src = _get_level(_mips.size());
+			}
 		}
 	protected:
-		int _ppm_get_next_digit(std::istream &acc) {
-			int c = std::ifstream::traits_type::eof();
-			while (acc) {
-				c = acc.get();
-				if (c == '#') {
-					while (acc) {
-						if (acc.get() == '\n') {
-							break;
+		// cursor over an image file that has been read into memory in one go
+		struct _netpbm_cursor {
+			const unsigned char *cur, *end;
+
+			void skip_space() {
+				while (cur != end) {
+					if (*cur == '#') {
+						while (cur != end && *cur != '\n') {
+							++cur;
 						}
+					} else if (*cur == ' ' || *cur == '\t' || *cur == '\r' || *cur == '\n') {
+						++cur;
+					} else {
+						break;
 					}
-				} else if (c >= '0' && c <= '9') {
-					return c;
 				}
 			}
-			return c;
+			bool next_num(size_t &res) {
+				skip_space();
+				if (cur == end || *cur < '0' || *cur > '9') {
+					return false;
+				}
+				for (res = 0; cur != end && *cur >= '0' && *cur <= '9'; ++cur) {
+					res = res * 10 + (*cur - '0');
+				}
+				return true;
+			}
+			bool next_float(rtt2_float &res) {
+				skip_space();
+				std::string token;
+				for (; cur != end && !std::isspace(*cur); ++cur) {
+					token.push_back(static_cast<char>(*cur));
+				}
+				if (token.empty()) {
+					return false;
+				}
+				res = std::strtod(token.c_str(), nullptr);
+				return true;
+			}
+			size_t remaining() const {
+				return static_cast<size_t>(end - cur);
+			}
+			// skips the single whitespace between the header & the raster
+			bool skip_separator() {
+				if (cur == end) {
+					return false;
+				}
+				++cur;
+				return true;
+			}
+			// whether there are at least rows rows of rowsz bytes left, without overflowing
+			bool has_rows(size_t rows, size_t rowsz) const {
+				return rowsz == 0 || remaining() / rowsz >= rows;
+			}
+		};
+
+		inline static void _read_all(std::istream &in, std::vector<unsigned char> &buf) {
+			constexpr size_t chunk = 1 << 20;
+			buf.clear();
+			while (in) {
+				size_t sz = buf.size();
+				buf.resize(sz + chunk);
+				in.read(reinterpret_cast<char*>(buf.data() + sz), chunk);
+				buf.resize(sz + static_cast<size_t>(in.gcount()));
+			}
+		}
+		inline static bool _is_little_endian() {
+			const unsigned short v = 1;
+			return *reinterpret_cast<const unsigned char*>(&v) == 1;
 		}
-		template <typename I> bool _ppm_get_next_num(std::istream &acc, I &res) {
-			int v = _ppm_get_next_digit(acc);
-			if (v < '0' || v > '9') {
+		// reads the size & the maximum value of a pnm header; false when they're missing or invalid
+		inline static bool _read_pnm_header(_netpbm_cursor &cur, size_t &w, size_t &h, size_t &maxv) {
+			return cur.next_num(w) && cur.next_num(h) && cur.next_num(maxv) && w > 0 && h > 0 && maxv > 0 && maxv <= 65535;
+		}
+		// 8-bit values for all samples up to maxv, the same as 255 * (v / maxv) truncated; maxv mustn't be 0
+		inline static void _make_netpbm_lut(size_t maxv, std::vector<unsigned char> &lut) {
+			lut.resize(maxv + 1);
+			for (size_t i = 0; i <= maxv; ++i) {
+				lut[i] = static_cast<unsigned char>(255 * (i / static_cast<rtt2_float>(maxv)));
+			}
+		}
+
+		// the loaders return false, before changing the texture, when the header is invalid or the raster is too short
+		bool _load_pnm_ascii(_netpbm_cursor &cur) {
+			size_t w = 0, h = 0, maxv = 0;
+			if (!_read_pnm_header(cur, w, h, maxv) || w > cur.remaining() || !cur.has_rows(h, w)) { // at least a byte per texel
 				return false;
 			}
-			res = v - '0';
-			while (acc) {
-				int c = acc.get();
-				if (c >= '0' && c <= '9') {
-					res = res * 10 + (c - '0');
-				} else {
-					acc.unget();
-					break;
+			reset(w, h);
+			std::vector<unsigned char> lut;
+			_make_netpbm_lut(maxv, lut);
+			for (size_t y = 0; y < _h; ++y) {
+				device_color *dst = get_at(0, _h - y - 1);
+				for (size_t x = 0; x < _w; ++x, ++dst) {
+					size_t r = 0, g = 0, b = 0;
+					cur.next_num(r);
+					cur.next_num(g);
+					cur.next_num(b);
+					dst->set(255, lut[std::min(r, maxv)], lut[std::min(g, maxv)], lut[std::min(b, maxv)]);
 				}
 			}
 			return true;
 		}
+		bool _load_pnm_binary(_netpbm_cursor &cur, size_t channels) {
+			size_t w = 0, h = 0, maxv = 0;
+			if (!_read_pnm_header(cur, w, h, maxv) || !cur.skip_separator()) {
+				return false;
+			}
+			size_t bytes = (maxv > 255 ? 2 : 1);
+			if (w > cur.remaining() || !cur.has_rows(h, w * channels * bytes)) {
+				return false;
+			}
+			reset(w, h);
+			std::vector<unsigned char> lut;
+			_make_netpbm_lut(maxv, lut);
+			size_t rowsz = _w * channels * bytes;
+			for (size_t y = 0; y < _h; ++y, cur.cur += rowsz) {
+				device_color *dst = get_at(0, _h - y - 1);
+				const unsigned char *src = cur.cur;
+				if (bytes == 1) {
+					if (channels == 3) {
+						for (size_t x = 0; x < _w; ++x, ++dst, src += 3) {
+							dst->set(255, lut[std::min<size_t>(src[0], maxv)], lut[std::min<size_t>(src[1], maxv)], lut[std::min<size_t>(src[2], maxv)]);
+						}
+					} else {
+						for (size_t x = 0; x < _w; ++x, ++dst, ++src) {
+							unsigned char v = lut[std::min<size_t>(*src, maxv)];
+							dst->set(255, v, v, v);
+						}
+					}
+				} else { // 16-bit samples are big-endian
+					for (size_t x = 0; x < _w; ++x, ++dst, src += channels * 2) {
+						unsigned char c[3];
+						for (size_t i = 0; i < channels; ++i) {
+							c[i] = lut[std::min<size_t>((static_cast<size_t>(src[i * 2]) << 8) | src[i * 2 + 1], maxv)];
+						}
+						if (channels == 1) {
+							c[1] = c[2] = c[0];
+						}
+						dst->set(255, c[0], c[1], c[2]);
+					}
+				}
+			}
+			return true;
+		}
+		// the floats go to the float cache, and clamped copies to the 8-bit texels
+		// the magnitude of the scale is ignored, only its sign (the byte order) is used
+		bool _load_pfm(_netpbm_cursor &cur, size_t channels) {
+			size_t w = 0, h = 0;
+			rtt2_float scale = 1.0;
+			if (!cur.next_num(w) || !cur.next_num(h) || w == 0 || h == 0 || !cur.next_float(scale) || !cur.skip_separator()) {
+				return false;
+			}
+			if (w > cur.remaining() || !cur.has_rows(h, w * channels * sizeof(float))) {
+				return false;
+			}
+			reset(w, h);
+			_carr_cache = new color_vec[_w * _h];
+			bool swap = ((scale < 0.0) != _is_little_endian());
+			const unsigned char *src = cur.cur;
+			color_vec *fdst = _carr_cache;
+			device_color *dst = _arr;
+			for (size_t i = _w * _h; i > 0; --i, ++fdst, ++dst) { // rows are stored bottom to top, same as the texture
+				float c[3];
+				for (size_t j = 0; j < channels; ++j, src += sizeof(float)) {
+					unsigned char bytes[sizeof(float)];
+					std::memcpy(bytes, src, sizeof(float));
+					if (swap) {
+						std::reverse(bytes, bytes + sizeof(float));
+					}
+					std::memcpy(c + j, bytes, sizeof(float));
+				}
+				if (channels == 1) {
+					c[1] = c[2] = c[0];
+				}
+				*fdst = color_vec(c[0], c[1], c[2], 1.0);
+				color_vec clamped = *fdst;
+				clamp_vec(clamped, 0.0, 1.0);
+				dst->from_vec4(clamped);
+			}
+			return true;
+		}
 	public:
+		// P3, P5, P6 and PF / Pf (PFM); the stream should be opened in binary mode
+		// the file is read in one go, and the texels are then rearranged into the current layout
+		// the texture is left empty when the file is invalid or truncated
 		void load_ppm(std::istream &fin) {
-			while (fin && fin.get() != 'P') {
+			texture_layout layout = _layout;
+			std::vector<unsigned char> data;
+			_read_all(fin, data);
+			_netpbm_cursor cur{ data.data(), data.data() + data.size() };
+			while (cur.cur != cur.end && *cur.cur != 'P') {
+				++cur.cur;
+			}
+			if (cur.remaining() < 2) {
+#ifdef DEBUG
+				throw std::invalid_argument("not a netpbm image");
+#endif
+				reset(0, 0);
+				return;
 			}
-			size_t w, h, maxv;
-			switch (fin.get()) {
+			++cur.cur;
+			bool loaded = false;
+			switch (*cur.cur++) {
 				case '3':
-					_ppm_get_next_num(fin, w);
-					_ppm_get_next_num(fin, h);
-					reset(w, h);
-					_ppm_get_next_num(fin, maxv);
-					for (size_t y = 0; y < _h; ++y) {
-						device_color *cur = get_at(0, _h - y - 1);
-						for (size_t x = 0; x < _w; ++x, ++cur) {
-							size_t r, g, b;
-							_ppm_get_next_num(fin, r);
-							_ppm_get_next_num(fin, g);
-							_ppm_get_next_num(fin, b);
-							cur->set(
-								255,
-								static_cast<unsigned char>(255 * (r / static_cast<rtt2_float>(maxv))),
-								static_cast<unsigned char>(255 * (g / static_cast<rtt2_float>(maxv))),
-								static_cast<unsigned char>(255 * (b / static_cast<rtt2_float>(maxv)))
-							);
-						}
-					}
+					loaded = _load_pnm_ascii(cur);
+					break;
+				case '5':
+					loaded = _load_pnm_binary(cur, 1);
 					break;
 				case '6':
-					_ppm_get_next_num(fin, w);
-					_ppm_get_next_num(fin, h);
-					reset(w, h);
-					_ppm_get_next_num(fin, maxv);
-					fin.get(); // get rid of the \n
-					for (size_t y = 0; y < _h; ++y) {
-						device_color *cur = get_at(0, _h - y - 1);
-						for (size_t x = 0; x < _w; ++x, ++cur) {
-							unsigned char
-								r = static_cast<unsigned char>(fin.get()),
-								g = static_cast<unsigned char>(fin.get()),
-								b = static_cast<unsigned char>(fin.get());
-							cur->set(
-								255,
-								static_cast<unsigned char>(255 * (r / static_cast<rtt2_float>(maxv))),
-								static_cast<unsigned char>(255 * (g / static_cast<rtt2_float>(maxv))),
-								static_cast<unsigned char>(255 * (b / static_cast<rtt2_float>(maxv)))
-							);
-						}
-						//fin.get_char();
-					}
+					loaded = _load_pnm_binary(cur, 3);
+					break;
+				case 'F':
+					loaded = _load_pfm(cur, 3);
+					break;
+				case 'f':
+					loaded = _load_pfm(cur, 1);
 					break;
-#ifdef DEBUG
 				default:
+#ifdef DEBUG
 					throw std::invalid_argument("image mode not implemented");
 #endif
+					break;
 			}
+			if (!loaded) {
+#ifdef DEBUG
+				throw std::invalid_argument("invalid or truncated image");
+#endif
+				reset(0, 0);
+				return;
+			}
+			set_layout(layout);
 		}
+		// binary P6, written a row at a time; the stream should be opened in binary mode
 		void save_ppm(std::ostream &out) const {
-			out << "P3\n" << _w << " " << _h << "\n255\n";
+			out << "P6\n" << _w << " " << _h << "\n255\n";
+			std::vector<unsigned char> row(_w * 3);
 			for (size_t y = _h; y > 0; ) {
-				device_color *cur = _arr + _w * --y;
-				for (size_t x = 0; x < _w; ++x, ++cur) {
-					out << cur->get_r() << " " << cur->get_g() << " " << cur->get_b() << " \t";
+				--y;
+				unsigned char *dst = row.data();
+				for (size_t x = 0; x < _w; ++x, dst += 3) {
+					const device_color *cur = get_at(x, y);
+					dst[0] = cur->get_r();
+					dst[1] = cur->get_g();
+					dst[2] = cur->get_b();
+				}
+				out.write(reinterpret_cast<const char*>(row.data()), row.size());
+			}
+		}
+		// color PFM in the native byte order, from the float cache if there is one
+		void save_pfm(std::ostream &out) const {
+			out << "PF\n" << _w << " " << _h << "\n" << (_is_little_endian() ? "-1.0" : "1.0") << "\n";
+			std::vector<float> row(_w * 3);
+			for (size_t y = 0; y < _h; ++y) {
+				float *dst = row.data();
+				for (size_t x = 0; x < _w; ++x, dst += 3) {
+					color_vec c;
+					fetch(x, y, c);
+					dst[0] = static_cast<float>(c.x);
+					dst[1] = static_cast<float>(c.y);
+					dst[2] = static_cast<float>(c.z);
 				}
-				out << "\n";
+				out.write(reinterpret_cast<const char*>(row.data()), row.size() * sizeof(float));
 			}
 		}
 
@@ -327,12 +657,98 @@ namespace rtt2 {
 			_h = buf.get_h();
 			_arr = buf.get_arr();
 			_own = false;
+			_layout = texture_layout::linear;
 		}
 	protected:
+		struct _mip_level {
+			size_t w, h;
+			std::vector<device_color> texels;
+			std::vector<color_vec> float_texels; // used instead when the texture has a float cache
+		};
+		struct _level_view {
+			size_t w, h;
+			texture_layout layout;
+			const device_color *arr;
+			const color_vec *farr;
+
+			size_t get_index(size_t x, size_t y) const {
+				return _get_texel_index(x, y, w, layout);
+			}
+			void load(size_t x, size_t y, color_vec &res) const {
+				size_t id = get_index(x, y);
+				if (farr) {
+					res = farr[id];
+				} else {
+					arr[id].to_vec4(res);
+				}
+			}
+		};
+
 		size_t _w, _h;
 		device_color *_arr = nullptr;
 		color_vec *_carr_cache = nullptr;
 		bool _own;
+		texture_layout _layout = texture_layout::linear;
+		std::vector<_mip_level> _mips; // levels after the base level
+
+		constexpr static size_t _tile_bits = 2, _tile_mask = (1 << _tile_bits) - 1;
+
+		inline static size_t _get_tile_count(size_t v) {
+			return (v + _tile_mask) >> _tile_bits;
+		}
+		inline static size_t _get_storage_size(size_t w, size_t h, texture_layout layout) {
+			if (layout == texture_layout::tiled) {
+				return (_get_tile_count(w) * _get_tile_count(h)) << (2 * _tile_bits);
+			}
+			return w * h;
+		}
+		inline static size_t _get_texel_index(size_t x, size_t y, size_t w, texture_layout layout) {
+			if (layout == texture_layout::tiled) {
+				return
+					(((y >> _tile_bits) * _get_tile_count(w) + (x >> _tile_bits)) << (2 * _tile_bits)) |
+					((y & _tile_mask) << _tile_bits) | (x & _tile_mask);
+			}
+			return w * y + x;
+		}
+		size_t _get_texel_index(size_t x, size_t y) const {
+			return _get_texel_index(x, y, _w, _layout);
+		}
+
+		_level_view _get_level(size_t level) const {
+			if (level == 0) {
+				return _level_view{ _w, _h, _layout, _arr, _carr_cache };
+			}
+			const _mip_level &lvl = _mips[level - 1];
+			return _level_view{ lvl.w, lvl.h, _layout, lvl.texels.data(), lvl.float_texels.empty() ? nullptr : lvl.float_texels.data() };
+		}
+		void _sample_bilinear(size_t level, const vec2 &uv, color_vec &res, uv_clamp_mode clampm) const {
+			switch (clampm) {
+				case uv_clamp_mode::repeat:
+					sample_bilinear<uv_clamp_mode::repeat>(level, uv, res);
+					break;
+				case uv_clamp_mode::rev_repeat:
+					sample_bilinear<uv_clamp_mode::rev_repeat>(level, uv, res);
+					break;
+				case uv_clamp_mode::repeat_border:
+					sample_bilinear<uv_clamp_mode::repeat_border>(level, uv, res);
+					break;
+			}
+		}
+		void _sample_trilinear(rtt2_float lod, const vec2 &uv, color_vec &res, uv_clamp_mode clampm) const {
+			if (lod <= 0.0) {
+				_sample_bilinear(0, uv, res, clampm);
+				return;
+			}
+			if (!(lod < _mips.size())) { // also when it's nan
+				_sample_bilinear(_mips.size(), uv, res, clampm);
+				return;
+			}
+			size_t level = static_cast<size_t>(lod);
+			color_vec next;
+			_sample_bilinear(level, uv, res, clampm);
+			_sample_bilinear(level + 1, uv, next, clampm);
+			res += (next - res) * (lod - level);
+		}
 
 		void _free_mem() {
 			if (_arr) {
@@ -343,6 +759,7 @@ namespace rtt2 {
 					delete[] _carr_cache;
 				}
 			}
+			_mips.clear();
 		}
 	};
 }
\ No newline at end of file
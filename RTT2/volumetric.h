@@ -0,0 +1,146 @@
+#pragma once
+
+#include <vector>
+#include <cmath>
+
+#include "settings.h"
+#include "utils.h"
+#include "vec.h"
+#include "mat.h"
+#include "color.h"
+#include "buffer.h"
+#include "light.h"
+#include "renderer.h"
+
+namespace rtt2 {
+	namespace rasterizing {
+		// single scattering in a uniform medium, for light shafts
+		// the scattered light is gathered at one point in each froxel, which is a screen tile split into slices whose depths
+		// grow exponentially, integrated front to back along the view rays, & looked up at the depth of each pixel
+		class volumetric_lighting {
+		public:
+			size_t width = 160, height = 90, slices = 64; // the size of the froxel grid
+			rtt2_float scattering = 0.1; // the fraction of the passing light that's scattered towards the camera, per unit length
+			rtt2_float extinction = 0.0; // the fraction of the light that's absorbed or scattered away, per unit length
+
+			// gathers the light of the scene, whose light caches are in view space, in the frustum of proj
+			// the samples are interleaved in the depths of their froxels, & jitter in [0, 1) offsets them all, so that
+			// changing it between frames & accumulating the results removes banding
+			void build(const scene_description &scene, const std::vector<light_cache> &lc, const mat4 &proj, rtt2_float jitter = 0.5) {
+				_proj = proj;
+				_znear = -_get_view_z(0.0);
+				_zfar = -_get_view_z(-1.0);
+				_slice_mult = slices / std::log(_zfar / _znear);
+				size_t layer = width * height;
+				_inscatter.resize(layer * slices);
+				_integrated.resize(layer * (slices + 1));
+				_transmittance.resize(layer * (slices + 1));
+				int n = static_cast<int>(layer * slices), ncols = static_cast<int>(layer);
+#pragma omp parallel for
+				for (int i = 0; i < n; ++i) {
+					size_t x = i % width, y = i / width % height, sl = i / layer;
+					rtt2_float off = jitter + _get_dither(x, y);
+					rtt2_float
+						z = -_get_slice_depth(sl + off - std::floor(off)), w = _proj[2][3] * z + _proj[3][3],
+						nx = (2 * x + 1) / static_cast<rtt2_float>(width) - 1.0, ny = (2 * y + 1) / static_cast<rtt2_float>(height) - 1.0;
+					vec3 p((nx * w - _proj[2][0] * z - _proj[3][0]) / _proj[0][0], (ny * w - _proj[2][1] * z - _proj[3][1]) / _proj[1][1], z);
+					color_vec_rgb res(0.0, 0.0, 0.0);
+					for (size_t l = 0; l < scene.lights.size(); ++l) {
+						vec3 dir;
+						color_vec_rgb c;
+						if (scene.lights[l].data->get_illum(lc[l], p, dir, c)) {
+							rtt2_float vis = scene.lights[l].get_visibility(p);
+							if (vis > 0.0) {
+								res += c * vis;
+							}
+						}
+					}
+					_inscatter[i] = res * scattering;
+				}
+#pragma omp parallel for
+				for (int i = 0; i < ncols; ++i) {
+					color_vec_rgb acc(0.0, 0.0, 0.0);
+					rtt2_float tr = 1.0;
+					_integrated[i] = acc;
+					_transmittance[i] = tr;
+					for (size_t sl = 0; sl < slices; ++sl) {
+						rtt2_float
+							len = _get_slice_depth(sl + 1.0) - _get_slice_depth(static_cast<rtt2_float>(sl)),
+							ext = std::exp(-extinction * len), w = (extinction > 0.0 ? (1.0 - ext) / extinction : len);
+						acc += _inscatter[sl * layer + i] * (tr * w);
+						tr *= ext;
+						_integrated[(sl + 1) * layer + i] = acc;
+						_transmittance[(sl + 1) * layer + i] = tr;
+					}
+				}
+			}
+			// composites the light onto the color buffer of bs, whose depth buffer was rendered with the projection that the
+			// grid was built with; the grid is sampled trilinearly at the depth of each pixel, so that it doesn't bleed
+			// across the edges of objects
+			void apply(const buffer_set &bs) const {
+				int h = static_cast<int>(bs.h);
+				rtt2_float sx = width / static_cast<rtt2_float>(bs.w), sy = height / static_cast<rtt2_float>(bs.h);
+#pragma omp parallel for
+				for (int y = 0; y < h; ++y) {
+					for (size_t x = 0; x < bs.w; ++x) {
+						rtt2_float depth = clamp(-_get_view_z(*bs.get_at(x, y, bs.depth_arr)), _znear, _zfar);
+						color_vec_rgb s;
+						rtt2_float tr;
+						_sample((x + 0.5) * sx - 0.5, (y + 0.5) * sy - 0.5, std::log(depth / _znear) * _slice_mult, s, tr);
+						device_color *dc = bs.get_at(x, y, bs.color_arr);
+						vec4 c;
+						dc->to_vec4(c);
+						c = vec4(c.xyz() * tr + s, c.w);
+						clamp_vec(c, 0.0, 1.0);
+						dc->from_vec4(c);
+					}
+				}
+			}
+		protected:
+			mat4 _proj;
+			rtt2_float _znear, _zfar, _slice_mult;
+			std::vector<color_vec_rgb> _inscatter; // per froxel
+			std::vector<color_vec_rgb> _integrated; // from the near plane to the near side of each slice, & to the far plane
+			std::vector<rtt2_float> _transmittance; // the same as _integrated
+
+			// a 4x4 ordered dither, for the depths of the samples in their froxels
+			inline static rtt2_float _get_dither(size_t x, size_t y) {
+				static const rtt2_float pattern[16]{
+					0.5 / 16.0, 8.5 / 16.0, 2.5 / 16.0, 10.5 / 16.0,
+					12.5 / 16.0, 4.5 / 16.0, 14.5 / 16.0, 6.5 / 16.0,
+					3.5 / 16.0, 11.5 / 16.0, 1.5 / 16.0, 9.5 / 16.0,
+					15.5 / 16.0, 7.5 / 16.0, 13.5 / 16.0, 5.5 / 16.0
+				};
+				return pattern[(y % 4) * 4 + x % 4] - 0.5;
+			}
+			rtt2_float _get_view_z(rtt2_float ndcz) const {
+				return (_proj[3][2] - ndcz * _proj[3][3]) / (ndcz * _proj[2][3] - _proj[2][2]);
+			}
+			rtt2_float _get_slice_depth(rtt2_float sl) const {
+				return _znear * std::pow(_zfar / _znear, sl / slices);
+			}
+			void _sample(rtt2_float gx, rtt2_float gy, rtt2_float gs, color_vec_rgb &s, rtt2_float &tr) const {
+				gx = clamp<rtt2_float>(gx, 0.0, width - 1.0);
+				gy = clamp<rtt2_float>(gy, 0.0, height - 1.0);
+				gs = clamp<rtt2_float>(gs, 0.0, static_cast<rtt2_float>(slices));
+				size_t
+					x0 = static_cast<size_t>(gx), y0 = static_cast<size_t>(gy), s0 = static_cast<size_t>(gs),
+					x1 = std::min(x0 + 1, width - 1), y1 = std::min(y0 + 1, height - 1), s1 = std::min(s0 + 1, slices);
+				rtt2_float fx = gx - x0, fy = gy - y0, fs = gs - s0;
+				size_t xs[2]{ x0, x1 }, ys[2]{ y0, y1 }, ss[2]{ s0, s1 };
+				rtt2_float
+					wx[2]{ static_cast<rtt2_float>(1.0 - fx), fx },
+					wy[2]{ static_cast<rtt2_float>(1.0 - fy), fy },
+					ws[2]{ static_cast<rtt2_float>(1.0 - fs), fs };
+				s = color_vec_rgb(0.0, 0.0, 0.0);
+				tr = 0.0;
+				for (size_t k = 0; k < 8; ++k) {
+					size_t id = (ss[k >> 2] * height + ys[(k >> 1) & 1]) * width + xs[k & 1];
+					rtt2_float wt = wx[k & 1] * wy[(k >> 1) & 1] * ws[k >> 2];
+					s += _integrated[id] * wt;
+					tr += _transmittance[id] * wt;
+				}
+			}
+		};
+	}
+}